@@ -0,0 +1,362 @@
+/* End-to-end benchmark: generates deterministic .osmx sets and times each
+   stage of the pipeline on them, printing the results as JSON.
+
+   Build with: gcc -O2 -o bench bench.c -lm -pthread
+   Usage: ./bench [-n cards]... [-r renders] [-o results.json] [-b baseline.json] [-t tolerance]
+
+   -n may be repeated, the default is 100, 10000 and 1000000 cards. Only the
+   first -r cards (1000 by default) of a set are rendered and saved, which
+   says as much about throughput as rendering a million would. With -b the
+   cards per second of every stage are compared to an earlier result, and
+   the exit status is 1 if any is more than tolerance percent (10 by
+   default) slower. */
+#define OSMX_NO_MAIN
+#include "main.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_MIN_TIME 0.25  // Seconds a stage is repeated for, so that small sets are timed reliably
+#define MAX_SIZES 16
+
+enum { STAGE_PARSE, STAGE_WRITE_XML, STAGE_RENDER, STAGE_SAVE, STAGE_COUNT };
+const char *stage_names[STAGE_COUNT] = { "parse_osmx", "write_xml", "render_card", "save_farbfeld" };
+
+typedef struct {
+	double seconds;  // Per run
+	long cards, bytes;  // Per run
+} StageResult;
+
+typedef struct {
+	long cards;
+	StageResult stages[STAGE_COUNT];
+	long peak_rss_kb;
+} SetResult;
+
+uint64_t bench_seed;
+
+// xorshift64*: the corpus must be the same on every machine and run
+uint32_t bench_random(uint32_t n) {
+	bench_seed ^= bench_seed >> 12;
+	bench_seed ^= bench_seed << 25;
+	bench_seed ^= bench_seed >> 27;
+	return (uint32_t)((bench_seed * 2685821657736338717ull) >> 32) % n;
+}
+
+#define PICK(list) list[bench_random(sizeof(list) / sizeof(list[0]))]
+
+const char *adjectives[] = { "Ancient", "Blazing", "Crimson", "Distant", "Eternal", "Feral", "Gilded", "Hollow", "Iron", "Jade",
+	"Kindled", "Lost", "Molten", "Nameless", "Obsidian", "Pale", "Quiet", "Radiant", "Silent", "Twisted",
+	"Umbral", "Vengeful", "Withered", "Astral", "Broken", "Cursed", "Drowned", "Ember", "Frozen", "Grim" };
+const char *nouns[] = { "Sentinel", "Reckoning", "Archivist", "Tide", "Colossus", "Whisper", "Bastion", "Harbinger", "Pact", "Wanderer",
+	"Conflux", "Oracle", "Ruin", "Vanguard", "Covenant", "Drake", "Invocation", "Monolith", "Shepherd", "Tempest",
+	"Echo", "Fracture", "Gargoyle", "Hymn", "Lantern", "Marauder", "Nexus", "Outburst", "Prophet", "Revenant" };
+const char *subtypes[] = { "Human Wizard", "Elf Druid", "Goblin Warrior", "Spirit", "Dragon", "Zombie", "Angel", "Merfolk Rogue", "Beast", "Vampire Knight" };
+const char *sentences[] = {
+	"Flying", "Trample", "Haste", "Vigilance", "Deathtouch", "Lifelink", "Cascade.",
+	"When this creature enters the battlefield, draw a card.",
+	"Destroy target creature an opponent controls.",
+	"Counter target spell unless its controller pays {2}.",
+	"Return up to one target nonland permanent to its owner's hand.",
+	"Each opponent sacrifices a creature or artifact.",
+	"Search your library for a basic land card, put it onto the battlefield tapped, then shuffle.",
+	"At the beginning of your upkeep, you may exile the top card of your library. You may play it this turn.",
+	"{T}: Add one mana of any color.",
+	"Whenever another creature you control dies, put a +1/+1 counter on this creature.",
+	"Creatures you control get +1/+1 until end of turn.",
+	"Deal 3 damage to any target.",
+	"You gain 4 life. Scry 2.",
+	"Reveal cards from the top of your library until you reveal a noncreature spell with mana value 4 or less. You may cast it without paying its mana cost.",
+};
+
+// Append a generated card to file, returning its number of bytes
+void generate_card(FILE *file, long index) {
+	char name[MAX_LINE], cost[16] = "", type[MAX_LINE], main_type[32];
+	long a = index % 30, n = index / 30 % 30;
+	if (index < 900) snprintf(name, sizeof(name), "%s %s", adjectives[a], nouns[n]);
+	else snprintf(name, sizeof(name), "%s %s %ld", adjectives[a], nouns[n], index / 900);
+
+	// Most cards have one colour, some two or none; lands have no cost
+	int kind = bench_random(100);
+	const char *colours = "WUBRG";
+	int colour_count = bench_random(10) < 7 ? 1 : bench_random(2) ? 2 : 0;
+	int power = 0, toughness = 0, loyalty = 0;
+	if (kind < 40) {
+		strcpy(main_type, "Creature");
+		snprintf(type, sizeof(type), "%sCreature - %s", bench_random(10) ? "" : "Legendary ", PICK(subtypes));
+		power = 1 + bench_random(6);
+		toughness = 1 + bench_random(6);
+	} else if (kind < 55) {
+		strcpy(main_type, "Instant");
+		strcpy(type, "Instant");
+	} else if (kind < 70) {
+		strcpy(main_type, "Sorcery");
+		strcpy(type, "Sorcery");
+	} else if (kind < 80) {
+		strcpy(main_type, "Enchantment");
+		strcpy(type, "Enchantment");
+	} else if (kind < 88) {
+		strcpy(main_type, "Artifact");
+		strcpy(type, bench_random(3) ? "Artifact" : "Legendary Artifact");
+		colour_count = 0;
+	} else if (kind < 95) {
+		strcpy(main_type, "Land");
+		strcpy(type, "Land");
+		colour_count = -1;
+	} else {
+		strcpy(main_type, "Planeswalker");
+		strcpy(type, "Legendary Planeswalker");
+		loyalty = 2 + bench_random(5);
+	}
+	if (colour_count >= 0) {
+		int generic = bench_random(6);
+		if (generic || colour_count == 0) snprintf(cost, sizeof(cost), "%d", generic);
+		int first = bench_random(5);
+		for (int c = 0; c < colour_count; c++) {
+			int pips = 1 + (bench_random(4) == 0);
+			for (int p = 0; p < pips; p++) strncat(cost, &colours[(first + c) % 5], 1);
+		}
+	}
+
+	fprintf(file, "%s\n\tCost: %s\n\tType: %s\n\tMainType: %s\n\tText:\n", name, cost, type, main_type);
+	int lines = 1 + bench_random(4);
+	for (int l = 0; l < lines; l++) fprintf(file, "\t%s\n", PICK(sentences));
+	if (power) fprintf(file, "\tPower: %d\n\tToughness: %d\n", power, toughness);
+	if (loyalty) fprintf(file, "\tLoyalty: %d\n", loyalty);
+	static const char *rarities[] = { "Common", "Common", "Common", "Uncommon", "Uncommon", "Rare", "Mythic" };
+	fprintf(file, "\tMetadata:\n\t\tRarity: %s\n\n", PICK(rarities));
+}
+
+void generate_set(const char *filename, long cards) {
+	FILE *file = fopen(filename, "w");
+	if (!file) {
+		fprintf(stderr, "Cannot write %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	bench_seed = 0x9E3779B97F4A7C15ull ^ (uint64_t)cards;
+	for (long i = 0; i < cards; i++) generate_card(file, i);
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Cannot write %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+}
+
+double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+long file_size(const char *filename) {
+	struct stat st;
+	return stat(filename, &st) == 0 ? (long)st.st_size : 0;
+}
+
+void bench_set(SetResult *result, long cards, int renders) {
+	char osmx[64], xml[64], image[64];
+	snprintf(osmx, sizeof(osmx), "bench-%ld.osmx", cards);
+	snprintf(xml, sizeof(xml), "bench-%ld.xml", cards);
+	snprintf(image, sizeof(image), "bench-%ld.ff", cards);
+	generate_set(osmx, cards);
+	result->cards = cards;
+
+	// Every stage is repeated until it has run for BENCH_MIN_TIME, and the time of one run is kept
+	int runs = 0;
+	double start = now(), elapsed;
+	do {
+		reset_set();
+		parse_osmx(osmx, 0);
+		runs++;
+	} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+	result->stages[STAGE_PARSE] = (StageResult){ elapsed / runs, entry_count, file_size(osmx) };
+
+	runs = 0;
+	start = now();
+	do {
+		FILE *file = fopen(xml, "w");
+		if (!file || write_xml(file, "BENCH", "Benchmark", "2000-01-01", 0) != 0) {
+			fprintf(stderr, "Cannot write %s: %s\n", xml, strerror(errno));
+			exit(1);
+		}
+		runs++;
+	} while ((elapsed = now() - start) < BENCH_MIN_TIME);
+	result->stages[STAGE_WRITE_XML] = (StageResult){ elapsed / runs, entry_count, file_size(xml) };
+
+	// Rendering runs on one thread: cards per second per core
+	int count = entry_count < renders ? entry_count : renders;
+	Image *img = new_image(WIDTH, HEIGHT);
+	if (!img) {
+		perror("Cannot allocate image");
+		exit(1);
+	}
+	double render_time = 0, save_time = 0;
+	runs = 0;
+	do {
+		for (int i = 0; i < count; i++) {
+			double t = now();
+			render_card(img, &entries[i]);
+			double t2 = now();
+			if (save_farbfeld(image, img) != 0) {
+				fprintf(stderr, "Cannot write %s: %s\n", image, strerror(errno));
+				exit(1);
+			}
+			render_time += t2 - t;
+			save_time += now() - t2;
+		}
+		runs++;
+	} while (render_time + save_time < BENCH_MIN_TIME && count > 0);
+	long image_bytes = file_size(image);
+	result->stages[STAGE_RENDER] = (StageResult){ render_time / runs, count, (long)count * img->width * img->height * 3 };
+	result->stages[STAGE_SAVE] = (StageResult){ save_time / runs, count, (long)count * image_bytes };
+	free_image(img);
+
+	unlink(osmx);
+	unlink(xml);
+	unlink(image);
+	reset_set();
+}
+
+/* Benchmark a set in a child process, so that its peak resident set size
+   is its own rather than that of the largest set benchmarked before it. */
+void bench_child(SetResult *result, long cards, int renders) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("Cannot create pipe");
+		exit(1);
+	}
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Cannot fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		bench_set(result, cards, renders);
+		if (write(fds[1], result, sizeof(*result)) != sizeof(*result)) _exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	ssize_t got = read(fds[0], result, sizeof(*result));
+	close(fds[0]);
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || got != sizeof(*result)) {
+		fprintf(stderr, "Benchmarking %ld cards failed\n", cards);
+		exit(1);
+	}
+	result->peak_rss_kb = usage.ru_maxrss;
+}
+
+void print_results(FILE *file, const SetResult *results, int count) {
+	fprintf(file, "{\n\t\"renderer_version\": %d,\n\t\"sets\": [\n", RENDERER_VERSION);
+	for (int i = 0; i < count; i++) {
+		const SetResult *set = &results[i];
+		fprintf(file, "\t\t{ \"cards\": %ld, \"peak_rss_kb\": %ld, \"stages\": {\n", set->cards, set->peak_rss_kb);
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			const StageResult *stage = &set->stages[s];
+			double seconds = stage->seconds > 0 ? stage->seconds : 1e-9;
+			fprintf(file, "\t\t\t\"%s\": { \"cards\": %ld, \"seconds\": %.6f, \"cards_per_sec\": %.1f, \"bytes_per_sec\": %.1f }%s\n",
+				stage_names[s], stage->cards, stage->seconds, stage->cards / seconds, stage->bytes / seconds, s + 1 < STAGE_COUNT ? "," : "");
+		}
+		fprintf(file, "\t\t} }%s\n", i + 1 < count ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+}
+
+/* Compare with a baseline printed by print_results(): only that layout is
+   understood, one set per line followed by a line per stage. Returns the
+   number of stages that got slower than tolerance allows. */
+int compare_baseline(const char *filename, const SetResult *results, int count, double tolerance) {
+	FILE *file = fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "Cannot read baseline %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	char line[MAX_LINE];
+	const SetResult *set = NULL;
+	int regressions = 0;
+	while (fgets(line, sizeof(line), file)) {
+		long cards;
+		char *p;
+		if ((p = strstr(line, "{ \"cards\": ")) && strstr(line, "\"stages\"") && sscanf(p, "{ \"cards\": %ld", &cards) == 1) {
+			set = NULL;
+			for (int i = 0; i < count; i++) {
+				if (results[i].cards == cards) set = &results[i];
+			}
+			continue;
+		}
+		if (!set) continue;
+		for (int s = 0; s < STAGE_COUNT; s++) {
+			char key[64];
+			snprintf(key, sizeof(key), "\"%s\": {", stage_names[s]);
+			double baseline;
+			if (!(p = strstr(line, key)) || !(p = strstr(p, "\"cards_per_sec\": ")) || sscanf(p, "\"cards_per_sec\": %lf", &baseline) != 1) continue;
+			const StageResult *stage = &set->stages[s];
+			double current = stage->cards / (stage->seconds > 0 ? stage->seconds : 1e-9);
+			double change = baseline > 0 ? (current - baseline) / baseline * 100 : 0;
+			int slower = change < -tolerance;
+			regressions += slower;
+			fprintf(stderr, "%8ld cards  %-14s %12.1f -> %12.1f cards/s  %+6.1f%%%s\n", set->cards, stage_names[s], baseline, current, change, slower ? "  REGRESSION" : "");
+		}
+	}
+	fclose(file);
+	return regressions;
+}
+
+int main(int argc, char **argv) {
+	long sizes[MAX_SIZES];
+	int size_count = 0, renders = 1000;
+	const char *output = NULL, *baseline = NULL;
+	double tolerance = 10;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc || argv[i][0] != '-' || !argv[i][1] || argv[i][2]) {
+			fprintf(stderr, "Usage: %s [-n cards]... [-r renders] [-o results.json] [-b baseline.json] [-t tolerance]\n", argv[0]);
+			return 2;
+		}
+		switch (argv[i][1]) {
+			case 'n':
+				if (size_count < MAX_SIZES) sizes[size_count++] = atol(argv[++i]);
+				break;
+			case 'r':
+				renders = atoi(argv[++i]);
+				break;
+			case 'o':
+				output = argv[++i];
+				break;
+			case 'b':
+				baseline = argv[++i];
+				break;
+			case 't':
+				tolerance = atof(argv[++i]);
+				break;
+			default:
+				fprintf(stderr, "Unknown option %s\n", argv[i]);
+				return 2;
+		}
+	}
+	if (!size_count) {
+		sizes[size_count++] = 100;
+		sizes[size_count++] = 10000;
+		sizes[size_count++] = 1000000;
+	}
+
+	SetResult results[MAX_SIZES] = { 0 };
+	for (int i = 0; i < size_count; i++) {
+		fprintf(stderr, " >> Benchmarking %ld cards...\n", sizes[i]);
+		bench_child(&results[i], sizes[i], renders);
+	}
+
+	print_results(stdout, results, size_count);
+	if (output) {
+		FILE *file = fopen(output, "w");
+		if (!file) {
+			fprintf(stderr, "Cannot write %s: %s\n", output, strerror(errno));
+			return 1;
+		}
+		print_results(file, results, size_count);
+		fclose(file);
+	}
+	if (baseline && compare_baseline(baseline, results, size_count, tolerance) > 0) return 1;
+	return 0;
+}
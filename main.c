@@ -3,94 +3,789 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MAX_LINE 1024
-#define MAX_ENTRIES 100
+#define ARENA_BLOCK 65536
+#define MAX_WORKERS 64
+#define STREAM_BATCH 64  // Entries held in memory at once by the streaming mode
 
-#define LOG(msg) if(verbose) printf("\t[v]  " msg);
-#define LOGX(msg, ...) if(verbose) printf("\t[v+] " msg, __VA_ARGS__);
+/* Verbose logging is asynchronous: a log site copies a pointer to itself,
+   which identifies its format, and its raw arguments into a ring owned by
+   the calling thread, and a background thread formats them later. Strings
+   are copied, since arena strings do not outlive a streaming batch.
+   Build with -DOSMX_NO_LOG to compile every log site out. */
+#ifdef OSMX_NO_LOG
+#define LOG_ENABLED 0
+#else
+#define LOG_ENABLED verbose
+#endif
+#define LOG(msg) if(LOG_ENABLED) do { static LogSite site = { .format = "\t[v]  " msg }; log_record(&site); } while(0);
+#define LOGX(msg, ...) if(LOG_ENABLED) do { static LogSite site = { .format = "\t[v+] " msg }; log_record(&site, __VA_ARGS__); } while(0);
 
-typedef struct Metadata {
-	char key[MAX_LINE];
-	char value[MAX_LINE];
-	struct Metadata *next;
-} Metadata;
+#define LOG_RING_SIZE (1 << 22)  // Bytes per thread
+#define LOG_MAX_STRING 4096  // Longer string arguments are cut
+#define LOG_MAX_ARGS 16
 
+// What a log site records: the argument types are worked out from the format on its first use
 typedef struct {
-	char name[MAX_LINE];
-	char cost[MAX_LINE];
-	char type[MAX_LINE];
-	char mainType[MAX_LINE];
-	char text[MAX_LINE * 2];
-	char power[MAX_LINE];
-	char toughness[MAX_LINE];
-	char loyalty[MAX_LINE];
-	Metadata *metadata;  // Linked list of metadata
+	const char *format;
+	atomic_int state;  // 0 until types is known, 1 while a thread fills it in, 2 once it is
+	int count;
+	char types[LOG_MAX_ARGS];
+} LogSite;
+
+// Single producer, single consumer: only the owning thread moves head, only the log thread moves tail
+typedef struct LogRing {
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+	struct LogRing *next;
+	uint8_t data[LOG_RING_SIZE];
+} LogRing;
+
+// A record is its site, its size in bytes and then its arguments, 8 byte aligned; the whole record is 16 byte aligned
+typedef struct {
+	const LogSite *site;  // NULL for the padding that skips the end of the ring
+	uint64_t size;
+} LogHeader;
+
+_Atomic(LogRing *) log_rings;
+_Thread_local LogRing *log_ring;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;  // Held by whoever is formatting
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+pthread_once_t log_started = PTHREAD_ONCE_INIT;
+atomic_int log_threaded;  // Whether the log thread could be started
+FILE *log_out;  // A copy of stdout, once an XML export has closed stdout itself; NULL before
+int log_stdout_closed;
+atomic_ulong log_recorded, log_written;  // Records, so that the exit can tell whether any were lost
+
+// The conversion at f, a '%': its type ('s' string, 'f' double, 'l' 64-bit or 'i' int, 0 for "%%") and where it ends
+const char *log_conversion(const char *f, char *type) {
+	int longs = 0;
+	for (f++; *f && strchr("-+ #0123456789.hlLqjzt", *f); f++) {
+		if (strchr("lLqjzt", *f)) longs = 1;
+	}
+	if (*f == '%') *type = 0;
+	else if (*f == 's') *type = 's';
+	else if (strchr("fFeEgGaA", *f)) *type = 'f';
+	else if (*f == 'p') *type = 'l';
+	else *type = longs ? 'l' : 'i';
+	return *f ? f + 1 : f;
+}
+
+// Print one record: every conversion of the format is formatted on its own with its stored argument
+void log_format(FILE *out, const char *format, const uint8_t *args) {
+	char spec[32];
+	for (const char *f = format; *f;) {
+		const char *percent = strchr(f, '%');
+		if (!percent) {
+			fwrite_unlocked(f, 1, strlen(f), out);
+			break;
+		}
+		fwrite_unlocked(f, 1, percent - f, out);
+		char type;
+		f = log_conversion(percent, &type);
+		if (!type) {
+			fputc_unlocked('%', out);
+			continue;
+		}
+		int plain = f - percent == 2;  // %s and %d need no printf
+		if (!plain) snprintf(spec, sizeof(spec), "%.*s", (int)(f - percent), percent);
+		if (type == 's') {
+			uint32_t len;
+			memcpy(&len, args, 4);
+			if (plain) fwrite_unlocked(args + 4, 1, len, out);
+			else fprintf(out, spec, (const char *)args + 4);
+			args += (4 + len + 1 + 7) & ~7u;
+		} else {
+			union { int i; long long l; double d; } value;
+			memcpy(&value, args, 8);
+			if (type == 'i' && plain && percent[1] == 'd') {
+				char digits[12], *d = digits + sizeof(digits);
+				unsigned u = value.i < 0 ? -(unsigned)value.i : (unsigned)value.i;
+				do *--d = '0' + u % 10; while (u /= 10);
+				if (value.i < 0) *--d = '-';
+				fwrite_unlocked(d, 1, digits + sizeof(digits) - d, out);
+			}
+			else if (type == 'f') fprintf(out, spec, value.d);
+			else if (type == 'l') fprintf(out, spec, value.l);
+			else fprintf(out, spec, value.i);
+			args += 8;
+		}
+	}
+}
+
+// Format everything recorded so far, with log_lock held. Returns whether there was anything
+int log_drain_locked() {
+	int drained = 0;
+	FILE *out = log_stdout_closed ? log_out : stdout;  // Records are dropped if stdout could not be copied
+	if (out) flockfile(out);
+	for (LogRing *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		while (tail != head) {
+			LogHeader header;
+			memcpy(&header, ring->data + tail % LOG_RING_SIZE, sizeof(header));
+			if (header.site && out) {
+				log_format(out, header.site->format, ring->data + tail % LOG_RING_SIZE + sizeof(header));
+				atomic_fetch_add_explicit(&log_written, 1, memory_order_relaxed);
+			}
+			tail += header.size;
+			drained = 1;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+	if (out) {
+		funlockfile(out);
+		if (drained) fflush(out);
+	}
+	return drained;
+}
+
+int log_drain() {
+	pthread_mutex_lock(&log_lock);
+	int drained = log_drain_locked();
+	pthread_mutex_unlock(&log_lock);
+	return drained;
+}
+
+/* Called by the XML export before it closes stdout: what is recorded so far
+   is written to stdout first, and later records go to a copy of it. */
+void log_before_stdout_close() {
+	pthread_mutex_lock(&log_lock);
+	if (!log_stdout_closed) {
+		log_drain_locked();
+		int fd = dup(STDOUT_FILENO);
+		log_out = fd >= 0 ? fdopen(fd, "w") : NULL;
+		log_stdout_closed = 1;
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+void *log_thread(void *arg) {
+	(void)arg;
+	for (;;) {
+		if (log_drain()) continue;
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += 10000000;  // Records are never left waiting for more than 10 ms
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&log_lock);
+		pthread_cond_timedwait(&log_wake, &log_lock, &until);
+		pthread_mutex_unlock(&log_lock);
+	}
+	return NULL;
+}
+
+void log_flush_at_exit(void) {
+	log_drain();
+	unsigned long lost = atomic_load(&log_recorded) - atomic_load(&log_written);
+	if (lost) fprintf(stderr, "%lu verbose log lines were lost\n", lost);
+}
+
+void log_start() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, log_thread, NULL) == 0) {
+		pthread_detach(thread);
+		atomic_store(&log_threaded, 1);
+	}
+	atexit(log_flush_at_exit);
+}
+
+// Reserve size bytes of the thread's ring, waiting for the log thread if it is full
+uint8_t *log_reserve(size_t size) {
+	LogRing *ring = log_ring;
+	if (!ring) {
+		pthread_once(&log_started, log_start);
+		ring = log_ring = malloc(sizeof(LogRing));
+		if (!ring) {
+			perror("Cannot allocate log");
+			exit(1);
+		}
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		ring->next = atomic_load(&log_rings);
+		while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+	}
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t skip = LOG_RING_SIZE - head % LOG_RING_SIZE;  // Records never wrap: skip the end if it is too short
+	if (skip >= size) skip = 0;
+	while (head + skip + size - atomic_load_explicit(&ring->tail, memory_order_acquire) > LOG_RING_SIZE) {
+		if (!atomic_load(&log_threaded)) {
+			log_drain();  // Without a log thread, the producers format their records themselves
+			continue;
+		}
+		pthread_cond_signal(&log_wake);
+		sched_yield();
+	}
+	if (skip) {
+		LogHeader pad = { NULL, skip };
+		memcpy(ring->data + head % LOG_RING_SIZE, &pad, sizeof(pad));
+		head += skip;
+		atomic_store_explicit(&ring->head, head, memory_order_release);
+	}
+	return ring->data + head % LOG_RING_SIZE;
+}
+
+// The argument types of a site's format, filled in by the first thread to use it
+const char *log_types(LogSite *site, char *types, int *count) {
+	if (atomic_load_explicit(&site->state, memory_order_acquire) == 2) {
+		*count = site->count;
+		return site->types;
+	}
+	*count = 0;
+	for (const char *f = strchr(site->format, '%'); f && *count < LOG_MAX_ARGS; f = strchr(f, '%')) {
+		f = log_conversion(f, &types[*count]);
+		if (types[*count]) ++*count;
+	}
+	int unset = 0;
+	if (atomic_compare_exchange_strong(&site->state, &unset, 1)) {
+		memcpy(site->types, types, *count);
+		site->count = *count;
+		atomic_store_explicit(&site->state, 2, memory_order_release);
+	}
+	return types;
+}
+
+// Record a message for the log thread. Only the conversions printf() takes with one argument are supported
+void log_record(LogSite *site, ...) {
+	char local[LOG_MAX_ARGS];
+	int count;
+	const char *types = log_types(site, local, &count);
+
+	// Size the record first, then copy the arguments in
+	va_list args;
+	size_t size = sizeof(LogHeader), lens[LOG_MAX_ARGS];
+	va_start(args, site);
+	for (int a = 0; a < count; a++) {
+		if (types[a] == 's') {
+			const char *s = va_arg(args, const char *);
+			lens[a] = strnlen(s ? s : "(null)", LOG_MAX_STRING);
+			size += (4 + lens[a] + 1 + 7) & ~(size_t)7;
+		} else {
+			if (types[a] == 'f') va_arg(args, double);
+			else if (types[a] == 'l') va_arg(args, long long);
+			else va_arg(args, int);
+			size += 8;
+		}
+	}
+	va_end(args);
+	size = (size + 15) & ~(size_t)15;  // So that whatever is left at the end of the ring can hold a LogHeader
+
+	uint8_t *record = log_reserve(size), *p = record + sizeof(LogHeader);
+	LogHeader header = { site, size };
+	memcpy(record, &header, sizeof(header));
+	va_start(args, site);
+	for (int a = 0; a < count; a++) {
+		if (types[a] == 's') {
+			const char *s = va_arg(args, const char *);
+			uint32_t len = lens[a];
+			memcpy(p, &len, 4);
+			memcpy(p + 4, s ? s : "(null)", len);
+			p[4 + len] = '\0';
+			p += (4 + len + 1 + 7) & ~(size_t)7;
+		} else {
+			union { int i; long long l; double d; } value = { 0 };
+			if (types[a] == 'f') value.d = va_arg(args, double);
+			else if (types[a] == 'l') value.l = va_arg(args, long long);
+			else value.i = va_arg(args, int);
+			memcpy(p, &value, 8);
+			p += 8;
+		}
+	}
+	va_end(args);
+	LogRing *ring = log_ring;
+	atomic_fetch_add_explicit(&log_recorded, 1, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + size, memory_order_release);
+}
+
+/* Card strings live in a per-set arena. Each one is stored as a 32-bit
+   length, the bytes and a terminating NUL, so a Str can be used as a plain
+   C string and still knows its length. Arena blocks never move, so a Str
+   stays valid until the arena is reset. */
+typedef const char *Str;
+
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t used, size;
+	_Alignas(4) char data[];
+} ArenaBlock;
+
+typedef struct {
+	ArenaBlock *head;  // Block currently being filled
+	ArenaBlock *spare;  // Blocks kept by arena_reset() for reuse
+} Arena;
+
+const char empty_str_storage[8];
+#define EMPTY_STR (empty_str_storage + 4)
+
+size_t str_len(Str s) {
+	return *(const uint32_t *)(s - 4);
+}
+
+// Allocate 4-byte aligned memory that lives until the arena is reset
+void *arena_alloc(Arena *arena, size_t size) {
+	size_t need = (size + 3) & ~(size_t)3;
+	ArenaBlock *block = arena->head;
+	if (!block || block->used + need > block->size) {
+		if (arena->spare && need <= arena->spare->size) {
+			block = arena->spare;
+			arena->spare = block->next;
+		} else {
+			size_t size = need > ARENA_BLOCK ? need : ARENA_BLOCK;
+			block = malloc(sizeof(ArenaBlock) + size);
+			if (!block) {
+				perror("Cannot allocate string arena");
+				exit(1);
+			}
+			block->size = size;
+		}
+		block->used = 0;
+		block->next = arena->head;
+		arena->head = block;
+	}
+	void *p = block->data + block->used;
+	block->used += need;
+	return p;
+}
+
+Str arena_str(Arena *arena, const char *s, size_t len) {
+	if (len == 0) return EMPTY_STR;
+	char *p = arena_alloc(arena, 4 + len + 1);
+	*(uint32_t *)p = len;
+	memcpy(p + 4, s, len);
+	p[4 + len] = '\0';
+	return p + 4;
+}
+
+// Move every block of src into dst, leaving src empty
+void arena_merge(Arena *dst, Arena *src) {
+	while (src->head) {
+		ArenaBlock *block = src->head;
+		src->head = block->next;
+		if (dst->head) {
+			block->next = dst->head->next;  // Keep filling dst's current block
+			dst->head->next = block;
+		} else {
+			block->next = NULL;
+			dst->head = block;
+		}
+	}
+}
+
+// Forget every string in the arena but keep its blocks around for the next set
+void arena_reset(Arena *arena) {
+	while (arena->head) {
+		ArenaBlock *next = arena->head->next;
+		arena->head->next = arena->spare;
+		arena->spare = arena->head;
+		arena->head = next;
+	}
+}
+
+// Growable scratch buffer for strings that are assembled piece by piece
+typedef struct {
+	char *data;
+	size_t len, cap;
+} StrBuf;
+
+void strbuf_append(StrBuf *buf, const char *s, size_t len) {
+	if (buf->len + len + 1 > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : 256;
+		while (cap < buf->len + len + 1) cap *= 2;
+		char *data = realloc(buf->data, cap);
+		if (!data) {
+			perror("Cannot grow buffer");
+			exit(1);
+		}
+		buf->data = data;
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, s, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+}
+
+uint32_t hash_bytes(const char *s, size_t len) {
+	uint32_t h = 2166136261u;  // FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (uint8_t)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+void *grow_array(void *array, uint32_t *cap, size_t item_size, uint32_t min_cap) {
+	uint32_t new_cap = *cap ? *cap * 2 : min_cap;
+	void *grown = realloc(array, new_cap * item_size);
+	if (!grown) {
+		perror("Cannot grow table");
+		exit(1);
+	}
+	*cap = new_cap;
+	return grown;
+}
+
+// Maps each distinct string to a small integer id, in order of first appearance
+typedef struct {
+	Str *strings;  // Indexed by id
+	uint32_t count, cap;
+	uint32_t *slots;  // Open addressing, id + 1 or 0 when empty
+	uint32_t slot_count;
+} InternTable;
+
+int intern_find(const InternTable *table, const char *s, size_t len) {
+	if (!table->slot_count) return -1;
+	for (uint32_t h = hash_bytes(s, len);; h++) {
+		uint32_t slot = table->slots[h & (table->slot_count - 1)];
+		if (!slot) return -1;
+		Str known = table->strings[slot - 1];
+		if (str_len(known) == len && memcmp(known, s, len) == 0) return slot - 1;
+	}
+}
+
+uint32_t intern(InternTable *table, Arena *arena, const char *s, size_t len) {
+	int found = intern_find(table, s, len);
+	if (found >= 0) return found;
+
+	if (2 * (table->count + 1) > table->slot_count) {
+		uint32_t slot_count = table->slot_count ? table->slot_count * 2 : 64;
+		free(table->slots);
+		table->slots = calloc(slot_count, sizeof(uint32_t));
+		if (!table->slots) {
+			perror("Cannot grow intern table");
+			exit(1);
+		}
+		table->slot_count = slot_count;
+		for (uint32_t id = 0; id < table->count; id++) {
+			uint32_t h = hash_bytes(table->strings[id], str_len(table->strings[id]));
+			while (table->slots[h & (slot_count - 1)]) h++;
+			table->slots[h & (slot_count - 1)] = id + 1;
+		}
+	}
+	if (table->count == table->cap) {
+		table->strings = grow_array(table->strings, &table->cap, sizeof(Str), 16);
+	}
+	uint32_t id = table->count++;
+	table->strings[id] = arena_str(arena, s, len);
+	uint32_t h = hash_bytes(s, len);
+	while (table->slots[h & (table->slot_count - 1)]) h++;
+	table->slots[h & (table->slot_count - 1)] = id + 1;
+	return id;
+}
+
+void intern_reset(InternTable *table) {
+	table->count = 0;
+	if (table->slots) memset(table->slots, 0, table->slot_count * sizeof(uint32_t));
+}
+
+// Sorted list of entry ids
+typedef struct {
+	uint32_t *ids;
+	uint32_t count, cap;
+} IdList;
+
+uint32_t idlist_lower_bound(const IdList *list, uint32_t id) {
+	uint32_t lo = 0, hi = list->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (list->ids[mid] < id) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+void idlist_insert(IdList *list, uint32_t id) {
+	uint32_t at = list->count;
+	if (at && list->ids[at - 1] >= id) {  // Appending in id order is the common case
+		at = idlist_lower_bound(list, id);
+		if (list->ids[at] == id) return;
+	}
+	if (list->count == list->cap) list->ids = grow_array(list->ids, &list->cap, sizeof(uint32_t), 4);
+	memmove(&list->ids[at + 1], &list->ids[at], (list->count - at) * sizeof(uint32_t));
+	list->ids[at] = id;
+	list->count++;
+}
+
+void idlist_remove(IdList *list, uint32_t id) {
+	uint32_t at = idlist_lower_bound(list, id);
+	if (at == list->count || list->ids[at] != id) return;
+	memmove(&list->ids[at], &list->ids[at + 1], (list->count - at - 1) * sizeof(uint32_t));
+	list->count--;
+}
+
+/* Metadata keys and values are interned per set, so an entry only keeps a
+   small flat table of (key id, value id) pairs in the set arena. */
+typedef struct {
+	uint32_t key;
+	uint32_t value;
+} MetaPair;
+
+typedef struct {
+	Str name;
+	Str cost;
+	Str type;
+	Str mainType;
+	Str text;
+	Str power;
+	Str toughness;
+	Str loyalty;
+	MetaPair *meta;
+	uint32_t meta_count, meta_cap;
+	uint32_t id;  // Stable across rejects, unlike the index in entries
 
 } Entry;
 
-void add_metadata(Metadata **head, const char *key, const char *value, int verbose) {
+Entry *entries;
+int entry_count = 0, entry_capacity = 0;
+Arena set_arena;  // Owns every Str of the loaded entries
+InternTable meta_keys, meta_values;
+
+int *entry_slots;  // Entry id -> index in entries, -1 once rejected
+uint32_t next_entry_id, entry_slot_cap;
+
+// Maps 64-bit keys to lists of entry ids
+typedef struct {
+	uint64_t key;
+	IdList list;
+} IdColumn;
+
+typedef struct {
+	IdColumn *columns;
+	uint32_t count, cap;
+	uint32_t *slots;  // Open addressing, column + 1 or 0 when empty
+	uint32_t slot_count;
+} IdIndex;
+
+uint32_t key_hash(uint64_t key) {
+	key *= 0x9E3779B97F4A7C15ull;
+	return key >> 32;
+}
+
+void idindex_place(IdIndex *index, uint32_t column) {
+	uint32_t h = key_hash(index->columns[column].key);
+	while (index->slots[h & (index->slot_count - 1)]) h++;
+	index->slots[h & (index->slot_count - 1)] = column + 1;
+}
+
+// The id list stored under key, created empty if create is set and NULL otherwise
+IdList *idindex_get(IdIndex *index, uint64_t key, int create) {
+	if (index->slot_count) {
+		for (uint32_t h = key_hash(key);; h++) {
+			uint32_t slot = index->slots[h & (index->slot_count - 1)];
+			if (!slot) break;
+			if (index->columns[slot - 1].key == key) return &index->columns[slot - 1].list;
+		}
+	}
+	if (!create) return NULL;
+
+	if (2 * (index->count + 1) > index->slot_count) {
+		uint32_t slot_count = index->slot_count ? index->slot_count * 2 : 64;
+		free(index->slots);
+		index->slots = calloc(slot_count, sizeof(uint32_t));
+		if (!index->slots) {
+			perror("Cannot grow index");
+			exit(1);
+		}
+		index->slot_count = slot_count;
+		for (uint32_t c = 0; c < index->count; c++) {
+			idindex_place(index, c);
+		}
+	}
+	if (index->count == index->cap) {
+		index->columns = grow_array(index->columns, &index->cap, sizeof(IdColumn), 16);
+	}
+	IdColumn *column = &index->columns[index->count];
+	column->key = key;
+	column->list = (IdList){ 0 };
+	idindex_place(index, index->count++);
+	return &column->list;
+}
+
+void idindex_reset(IdIndex *index) {
+	for (uint32_t c = 0; c < index->count; c++) {
+		free(index->columns[c].list.ids);
+	}
+	index->count = 0;
+	if (index->slots) memset(index->slots, 0, index->slot_count * sizeof(uint32_t));
+}
+
+/* Column index: every (key, value) pair that occurs in the set maps to the
+   ids of the entries carrying it, so "all cards with Rarity: Mythic" is one
+   lookup. Only entries in the entries table are indexed. */
+IdIndex meta_index;
+
+/* Trigram index over the name and text of every entry, used by the editor
+   search. Trigrams are case-folded, so one index serves both case-sensitive
+   and case-insensitive searches: it only narrows down the candidates, which
+   are then checked against the full query. It is built on the first search,
+   so conversions that never search do not pay for it, and kept up to date
+   from then on. */
+IdIndex search_index;
+int search_indexed = 0;  // Whether search_index covers the entries table
+int search_ignore_case = 0;
+
+IdList *meta_column(uint32_t key, uint32_t value, int create) {
+	return idindex_get(&meta_index, (uint64_t)key << 32 | value, create);
+}
+
+void index_metadata(const Entry *entry) {
+	for (uint32_t i = 0; i < entry->meta_count; i++) {
+		idlist_insert(meta_column(entry->meta[i].key, entry->meta[i].value, 1), entry->id);
+	}
+}
+
+void unindex_metadata(const Entry *entry) {
+	for (uint32_t i = 0; i < entry->meta_count; i++) {
+		IdList *list = meta_column(entry->meta[i].key, entry->meta[i].value, 0);
+		if (list) idlist_remove(list, entry->id);
+	}
+}
+
+// Ids of the entries whose key is value, in table order. Returns the number of ids
+uint32_t find_metadata(const char *key, const char *value, const uint32_t **ids) {
+	int key_id = intern_find(&meta_keys, key, strlen(key));
+	int value_id = intern_find(&meta_values, value, strlen(value));
+	IdList *list = key_id < 0 || value_id < 0 ? NULL : meta_column(key_id, value_id, 0);
+	*ids = list ? list->ids : NULL;
+	return list ? list->count : 0;
+}
+
+Str set_str(const char *s) {
+	return arena_str(&set_arena, s, strlen(s));
+}
+
+MetaPair *find_pair(const Entry *entry, const char *key) {
+	int key_id = intern_find(&meta_keys, key, strlen(key));
+	for (uint32_t i = 0; key_id >= 0 && i < entry->meta_count; i++) {
+		if (entry->meta[i].key == (uint32_t)key_id) return &entry->meta[i];
+	}
+	return NULL;
+}
+
+// Set key on an entry that is not in the entries table yet (it is indexed once collected)
+void add_metadata(Entry *entry, const char *key, const char *value, int verbose) {
 	LOGX("Adding metadata: %s\n", key);
-	Metadata *new_entry = malloc(sizeof(Metadata));
-	if (!new_entry) return;
-	strncpy(new_entry->key, key, MAX_LINE);
-	strncpy(new_entry->value, value, MAX_LINE);
-	new_entry->next = *head;
-	*head = new_entry;
-}
-
-char *get_metadata(Metadata *head, const char *key) {
-	while (head) {
-		if (strcmp(head->key, key) == 0) return head->value;
-		head = head->next;
-	}
-	return NULL;  // Not found
-}
-
-void edit_metadata(Metadata *head, const char *key, const char *new_value) {
-    while (head) {
-        if (strcmp(head->key, key) == 0) {
-            strncpy(head->value, new_value, MAX_LINE);
-            return;
-        }
-        head = head->next;
-    }
-}
-
-void delete_metadata(Metadata **head, const char *key) {
-	Metadata *curr = *head, *prev = NULL;
-	while (curr) {
-		if (strcmp(curr->key, key) == 0) {
-			if (prev) prev->next = curr->next;
-			else *head = curr->next;
-			free(curr);
+	uint32_t key_id = intern(&meta_keys, &set_arena, key, strlen(key));
+	uint32_t value_id = intern(&meta_values, &set_arena, value, strlen(value));
+	for (uint32_t i = 0; i < entry->meta_count; i++) {
+		if (entry->meta[i].key == key_id) {
+			entry->meta[i].value = value_id;
 			return;
 		}
-		prev = curr;
-		curr = curr->next;
 	}
+	if (entry->meta_count == entry->meta_cap) {
+		uint32_t cap = entry->meta_cap ? entry->meta_cap * 2 : 4;
+		MetaPair *grown = arena_alloc(&set_arena, cap * sizeof(MetaPair));
+		if (entry->meta_count) memcpy(grown, entry->meta, entry->meta_count * sizeof(MetaPair));
+		entry->meta = grown;
+		entry->meta_cap = cap;
+	}
+	entry->meta[entry->meta_count++] = (MetaPair){ key_id, value_id };
+}
+
+Str get_metadata(const Entry *entry, const char *key) {
+	MetaPair *pair = find_pair(entry, key);
+	return pair ? meta_values.strings[pair->value] : NULL;  // NULL if not found
+}
+
+// Set key on an entry of the entries table, keeping the column index up to date
+void edit_metadata(Entry *entry, const char *key, const char *new_value) {
+	unindex_metadata(entry);
+	add_metadata(entry, key, new_value, 0);
+	index_metadata(entry);
 }
 
-Entry entries[MAX_ENTRIES];
-int entry_count = 0;
+void delete_metadata(Entry *entry, const char *key) {
+	MetaPair *pair = find_pair(entry, key);
+	if (!pair) return;
+	unindex_metadata(entry);
+	*pair = entry->meta[--entry->meta_count];
+	index_metadata(entry);
+}
 
 #include "render.h"
 
+typedef void (*EntryFn)(Entry *entry, void *ctx);
+typedef void (*TaskFn)(int task, int worker, void *ctx);
+
 void parse_osmx(const char *filename, int verbose);
+void parse_osmx_stream(FILE *file, EntryFn emit, void *ctx, int verbose);
 int search_entries(const char *query, int start_index);
 void prompt_user();
-void write_xml(FILE *file, const char *set_name, const char *longname, const char *release_date, int verbose);
+int write_xml(FILE *file, const char *set_name, const char *longname, const char *release_date, int verbose);
+int stream_osmx(FILE *input, FILE *out, const char *set_name, const char *longname, const char *release_date, int render, int verbose);
+int watch_osmx(const char *input, const char *output, const char *set_name, const char *longname, const char *release_date, int render, int verbose);
+
+typedef struct {
+	char input[MAX_LINE], output[MAX_LINE];
+	char set_name[MAX_LINE], longname[MAX_LINE], release_date[MAX_LINE];
+} SetJob;
+
+void add_set(SetJob **sets, uint32_t *count, uint32_t *cap, const SetJob *set);
+void read_manifest(const char *filename, SetJob **sets, uint32_t *count, uint32_t *cap);
+int run_batch(SetJob *sets, uint32_t count, int output_flag, int render, int verbose);
+FILE *open_input(const char *filename);
 int calculate_cmc(const char *cost, int verbose);
 void get_unique_colors(const char *cost, char *colors, int verbose);
-void render_cards();
+int render_cards(const char *set_name);
+int render_entries(Entry *list, int count, int progress);
+typedef struct Atlas Atlas;
+Atlas *atlas_open(const char *set_name);
+void atlas_add(Atlas *atlas, Entry *list, int count);
+int atlas_close(Atlas *atlas);
+void render_cache_save();
+extern int render_cache_flag;
+extern int render_format;
+extern int atlas_flag;
+extern int render_width, render_height;
+extern char stats_file[MAX_LINE];
+void stats_report();
+void today(char *date);
+void reset_set();
+void clear_undo_log();
+void pool_init(int size);
+void pool_run(int tasks, TaskFn fn, void *ctx);
+int pool_size();
 
+#ifndef OSMX_NO_MAIN  // bench.c includes this file and has its own main()
 int main(int argc, char **argv) {
-	char input_file[MAX_LINE], output_file[MAX_LINE];
-	input_file[0] = output_file[0] = '\0';
-	char set_name[MAX_LINE], longname[MAX_LINE], release_date[MAX_LINE];
+	SetJob set = { 0 };  // The set given by the latest -i and the options after it
+	char *input_file = set.input, *output_file = set.output;
+	char *set_name = set.set_name, *longname = set.longname, *release_date = set.release_date;
+	SetJob *batch = NULL;
+	uint32_t batch_count = 0, batch_cap = 0;
+	int manifest_flag = 0;
 	
-	int render_flag = 0, edit_flag = 1, output_flag = 0, verbose_flag = 0;
+	int render_flag = 0, edit_flag = 1, output_flag = 0, verbose_flag = 0, stream_flag = 0, watch_flag = 0, jobs = 1;
 	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "--watch") == 0) {
+			watch_flag = 1;
+			continue;
+		}
+		if(strncmp(argv[i], "--stats", 7) == 0 && (argv[i][7] == '\0' || argv[i][7] == '=')) {
+			// --stats=<file> also writes the latency histograms there as JSON
+			if(!stats_enabled) atexit(stats_report);
+			stats_enabled = 1;
+			if(argv[i][7] == '=') snprintf(stats_file, MAX_LINE, "%s", argv[i] + 8);
+			continue;
+		}
 		if(argv[i][0] == '-') {
 			for(char *opt = argv[i]+1; *opt; ++opt) {
 				switch(*opt) {
@@ -112,13 +807,41 @@ int main(int argc, char **argv) {
 					case 'V':
 						verbose_flag = 0;
 						break;
+					case 's':
+						stream_flag = 1;
+						break;
+					case 'k':
+						render_cache_flag = 1;
+						break;
+					case 'K':
+						render_cache_flag = 0;
+						break;
+					case 'a':
+						atlas_flag = 1;
+						break;
+					case 'A':
+						atlas_flag = 0;
+						break;
 					case 'i':
 						if(i + 1 >= argc) {
 							printf("Expected another argument after -i\n");
 							exit(1);
 						}
+						if(input_file[0]) {
+							// Another set: everything from here on belongs to it
+							add_set(&batch, &batch_count, &batch_cap, &set);
+							set = (SetJob){ 0 };
+						}
 						strcpy(input_file, argv[++i]);
 						goto next_argument;
+					case 'm':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -m\n");
+							exit(1);
+						}
+						read_manifest(argv[++i], &batch, &batch_count, &batch_cap);
+						manifest_flag = 1;
+						goto next_argument;
 					case 'o':
 						if(i + 1 >= argc) {
 							printf("Expected another argument after -o\n");
@@ -142,12 +865,124 @@ int main(int argc, char **argv) {
 							exit(1);
 						}
 						goto next_argument;
+					case 'j':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -j\n");
+							exit(1);
+						}
+						jobs = atoi(argv[++i]);  // 0 means one worker per core
+						goto next_argument;
+					case 'f':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -f\n");
+							exit(1);
+						}
+						if(strcmp(argv[++i], "ff") == 0) {
+							render_format = FORMAT_FARBFELD;
+						} else if(strcmp(argv[i], "qoi") == 0) {
+							render_format = FORMAT_QOI;
+						} else if(strcmp(argv[i], "png") == 0) {
+							render_format = FORMAT_PNG;
+						} else {
+							printf("Expected ff, qoi or png after -f\n");
+							exit(1);
+						}
+						goto next_argument;
+					case 'w':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -w\n");
+							exit(1);
+						}
+						render_width = atoi(argv[++i]);
+						if(render_width < 16 || render_width > 8192) {
+							printf("Expected a card width from 16 to 8192 pixels after -w\n");
+							exit(1);
+						}
+						render_height = card_height(render_width);
+						goto next_argument;
+					case 't':
+						render_width = THUMBNAIL_WIDTH;
+						render_height = card_height(render_width);
+						break;
+					case 'c':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -c\n");
+							exit(1);
+						}
+						strcpy(set_name, argv[++i]);
+						goto next_argument;
+					case 'l':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -l\n");
+							exit(1);
+						}
+						strcpy(longname, argv[++i]);
+						goto next_argument;
+					case 'd':
+						if(i + 1 >= argc) {
+							printf("Expected another argument after -d\n");
+							exit(1);
+						}
+						strcpy(release_date, argv[++i]);
+						goto next_argument;
 				}
 			}
 		}
 		next_argument:
 	}
+	pool_init(jobs);
 	
+	if(batch_count > 0 || manifest_flag) {
+		if(input_file[0]) add_set(&batch, &batch_count, &batch_cap, &set);
+		if(output_flag == 1 && batch_count > 1) {
+			fprintf(stderr, "-n stdout takes a single set: the XML of several would run together\n");
+			return 1;
+		}
+		return run_batch(batch, batch_count, output_flag, render_flag, verbose_flag) != 0;
+	}
+
+	if(watch_flag) {
+		// Like streaming, watching never prompts: it is meant to be left running
+		if(!input_file[0] || strcmp(input_file, "-") == 0 || !set_name[0] || !longname[0]) {
+			printf("Watch mode needs -i <file>, -c and -l\n");
+			exit(1);
+		}
+		if(!output_file[0] && output_flag != 2) {
+			printf("Watch mode needs -o or -n none\n");
+			exit(1);
+		}
+		if(render_flag && atlas_flag) {
+			printf("Watch mode renders single cards, not an atlas\n");
+			exit(1);
+		}
+		if(!release_date[0]) today(release_date);
+		return watch_osmx(input_file, output_flag == 0 ? output_file : NULL, set_name, longname, release_date, render_flag, verbose_flag);
+	}
+
+	if(stream_flag) {
+		// Streaming never prompts: stdin may be the .osmx input itself
+		if(!input_file[0] || !set_name[0] || !longname[0]) {
+			printf("Streaming mode needs -i, -c and -l\n");
+			exit(1);
+		}
+		if(!output_file[0] && output_flag == 0) {
+			printf("Streaming mode needs -o or -n\n");
+			exit(1);
+		}
+		if(!release_date[0]) today(release_date);
+		FILE *file = NULL;
+		if(output_flag == 0) {
+			file = fopen(output_file, "w");
+			if(!file) {
+				printf("Cannot open file %s\n", output_file);
+				exit(1);
+			}
+		} else if(output_flag == 1) {
+			file = stdout;
+		}
+		return stream_osmx(open_input(input_file), file, set_name, longname, release_date, render_flag, verbose_flag) != 0;
+	}
+
 	if(!input_file[0]) {
 		printf("Enter the .osmx filename: ");
 		scanf("%s", input_file);
@@ -162,93 +997,233 @@ int main(int argc, char **argv) {
 		printf("Enter output .xml filename: ");
 		scanf("%s", output_file);
 	}
-	printf("Enter set name: ");
-	scanf(" %[^\n]s", set_name);
-	printf("Enter long name: ");
-	scanf(" %[^\n]s", longname);
-	printf("Enter release date (or press Enter for today's date): ");
-	while (getchar() != '\n'); // Clear input buffer
-	fgets(release_date, MAX_LINE, stdin);
-	if (release_date[0] == '\n') {
-		time_t t = time(NULL);
-		struct tm tm = *localtime(&t);
-		sprintf(release_date, "%d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+	if(!set_name[0]) {
+		printf("Enter set name: ");
+		scanf(" %[^\n]s", set_name);
+	}
+	if(!longname[0]) {
+		printf("Enter long name: ");
+		scanf(" %[^\n]s", longname);
+	}
+	if(!release_date[0]) {
+		printf("Enter release date (or press Enter for today's date): ");
+		while (getchar() != '\n'); // Clear input buffer
+		fgets(release_date, MAX_LINE, stdin);
+		if (release_date[0] == '\n') {
+			today(release_date);
+		}
 	}
 	
 	if(output_flag == 0) {
 		FILE *file = fopen(output_file, "w");
 		if(file) {
-			write_xml(file, set_name, longname, release_date, verbose_flag);
+			if(write_xml(file, set_name, longname, release_date, verbose_flag) != 0) {
+				printf("Cannot write file %s: %s\n", output_file, strerror(errno));
+				exit(1);
+			}
 		} else {
 			printf("Cannot open file %s\n", output_file);
 			exit(1);
 		}
 	} else if(output_flag == 1) {
-		write_xml(stdout, set_name, longname, release_date, verbose_flag);
+		if(write_xml(stdout, set_name, longname, release_date, verbose_flag) != 0) {
+			fprintf(stderr, "Cannot write XML: %s\n", strerror(errno));
+			exit(1);
+		}
 	}
 	
-	if(render_flag) render_cards();
+	if(render_flag && render_cards(set_name) != 0) return 1;
 	return 0;
 }
+#endif
 
-void parse_osmx(const char *filename, int verbose) {
-	FILE *file = fopen(filename, "r");
-	if (!file) {
-		perror("Error opening file");
-		exit(1);
-	}
+// Drop every entry and everything the set owns, keeping the allocations for reuse
+void reset_set() {
+	entry_count = 0;
+	next_entry_id = 0;
+	idindex_reset(&meta_index);
+	idindex_reset(&search_index);
+	search_indexed = 0;
+	intern_reset(&meta_keys);
+	intern_reset(&meta_values);
+	clear_undo_log();
+	arena_reset(&set_arena);
+}
 
-	char line[MAX_LINE], key[MAX_LINE], value[MAX_LINE];
-	Entry *current = NULL;
-	int reading_text = 0;
+void today(char *date) {
+	time_t t = time(NULL);
+	struct tm tm = *localtime(&t);
+	sprintf(date, "%d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
 
-	while (fgets(line, MAX_LINE, file)) {
-		if (line[0] != '\t' && line[0] != '\n') {
-			LOG("New entry\n");
-			// New entry
-			current = &entries[entry_count++];
-			LOGX("Number of entries: %d\n", entry_count);
-			strcpy(current->name, line);
+/* --stats report, printed to stderr at exit so that it never mixes with
+   XML on stdout. Percentiles are the upper bound of their histogram
+   bucket, so they are accurate to a factor of two. */
+char stats_file[MAX_LINE];
+
+double stats_percentile(const StatTimer *t, double fraction) {
+	unsigned long long count = atomic_load(&t->count), seen = 0;
+	double max = atomic_load(&t->max_ns);
+	for (int b = 0; b < STAT_BUCKETS; b++) {
+		seen += atomic_load(&t->buckets[b]);
+		if (seen > 0 && seen >= fraction * count) return (double)(1ull << b) < max ? (double)(1ull << b) : max;
+	}
+	return max;
+}
+
+void stats_report() {
+	fprintf(stderr, "\nStatistics:\n");
+	for (int c = 0; c < STAT_COUNTERS; c++) {
+		fprintf(stderr, "  %-16s %llu\n", stat_counter_names[c], (unsigned long long)atomic_load(&stat_counters[c]));
+	}
+	fprintf(stderr, "  %-8s %10s %12s %10s %10s %10s %10s\n", "stage", "count", "total ms", "mean us", "p50 us", "p99 us", "max us");
+	for (int t = 0; t < STAT_TIMERS; t++) {
+		const StatTimer *timer = &stat_timers[t];
+		unsigned long long count = atomic_load(&timer->count);
+		if (!count) continue;
+		double total = atomic_load(&timer->total_ns);
+		fprintf(stderr, "  %-8s %10llu %12.3f %10.1f %10.1f %10.1f %10.1f\n", stat_timer_names[t], count, total / 1e6, total / count / 1e3,
+			stats_percentile(timer, 0.5) / 1e3, stats_percentile(timer, 0.99) / 1e3, atomic_load(&timer->max_ns) / 1e3);
+	}
+	if (!stats_file[0]) return;
+
+	FILE *file = fopen(stats_file, "w");
+	if (!file) {
+		fprintf(stderr, "Cannot write %s: %s\n", stats_file, strerror(errno));
+		return;
+	}
+	fprintf(file, "{\n\t\"counters\": {");
+	for (int c = 0; c < STAT_COUNTERS; c++) {
+		fprintf(file, "%s\n\t\t\"%s\": %llu", c ? "," : "", stat_counter_names[c], (unsigned long long)atomic_load(&stat_counters[c]));
+	}
+	fprintf(file, "\n\t},\n\t\"timers\": {");
+	for (int t = 0; t < STAT_TIMERS; t++) {
+		const StatTimer *timer = &stat_timers[t];
+		fprintf(file, "%s\n\t\t\"%s\": { \"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"buckets\": [", t ? "," : "", stat_timer_names[t],
+			(unsigned long long)atomic_load(&timer->count), (unsigned long long)atomic_load(&timer->total_ns), (unsigned long long)atomic_load(&timer->max_ns));
+		// Only the buckets that counted something, each with the bound it counts latencies below
+		int first = 1;
+		for (int b = 0; b < STAT_BUCKETS; b++) {
+			unsigned long long n = atomic_load(&timer->buckets[b]);
+			if (!n) continue;
+			if (b + 1 < STAT_BUCKETS) fprintf(file, "%s{ \"below_ns\": %llu, \"count\": %llu }", first ? "" : ", ", 1ull << b, n);
+			else fprintf(file, "%s{ \"below_ns\": null, \"count\": %llu }", first ? "" : ", ", n);
+			first = 0;
+		}
+		fprintf(file, "] }");
+	}
+	fprintf(file, "\n\t}\n}\n");
+	if (fclose(file) != 0) fprintf(stderr, "Cannot write %s: %s\n", stats_file, strerror(errno));
+}
+
+FILE *open_input(const char *filename) {
+	if (strcmp(filename, "-") == 0) return stdin;
+	FILE *file = fopen(filename, "r");
+	if (!file) {
+		perror("Error opening file");
+		exit(1);
+	}
+	return file;
+}
+
+void collect_entry(Entry *entry, void *ctx) {
+	entry->id = next_entry_id++;
+	if (entry->id == entry_slot_cap) {
+		entry_slots = grow_array(entry_slots, &entry_slot_cap, sizeof(int), 64);
+	}
+	entry_slots[entry->id] = entry_count;
+	index_metadata(entry);
+	if (entry_count == entry_capacity) {
+		int capacity = entry_capacity ? entry_capacity * 2 : 64;
+		Entry *grown = realloc(entries, capacity * sizeof(Entry));
+		if (!grown) {
+			perror("Cannot grow entry table");
+			exit(1);
+		}
+		entries = grown;
+		entry_capacity = capacity;
+	}
+	entries[entry_count++] = *entry;
+}
+
+void parse_osmx(const char *filename, int verbose) {
+	FILE *file = open_input(filename);
+	parse_osmx_stream(file, collect_entry, NULL, verbose);
+	if (file != stdin) fclose(file);
+}
+
+// Hand a parsed entry over, keeping the time it takes out of the parse timer
+void parse_emit(EntryFn emit, Entry *entry, void *ctx, uint64_t *emit_ns) {
+	STAT_ADD(STAT_ENTRIES, 1);
+	STAT_START(start);
+	emit(entry, ctx);
+	if (stats_enabled) *emit_ns += stats_now() - start;
+}
+
+// Parse entries from file, handing each one to emit as soon as its block ends
+void parse_osmx_stream(FILE *file, EntryFn emit, void *ctx, int verbose) {
+	char line[MAX_LINE], key[MAX_LINE], value[MAX_LINE];
+	Entry entry, *current = NULL;
+	StrBuf text = { 0 };
+	int reading_text = 0, parsed = 0;
+
+	STAT_START(start);
+	uint64_t emit_ns = 0;
+	while (fgets(line, MAX_LINE, file)) {
+		STAT_ADD(STAT_PARSE_LINES, 1);
+		STAT_ADD(STAT_PARSE_BYTES, strlen(line));
+		if (line[0] != '\t' && line[0] != '\n') {
+			if (current) {
+				current->text = arena_str(&set_arena, text.data, text.len);
+				parse_emit(emit, current, ctx, &emit_ns);
+			}
+			LOG("New entry\n");
+			// New entry
+			current = &entry;
+			LOGX("Number of entries: %d\n", ++parsed);
+			current->name = set_str(line);
 			LOGX("Entry name: %s\n", current->name);
-			current->text[0] = '\0';
-			current->power[0] = '\0';
-			current->toughness[0] = '\0';
-			current->loyalty[0] = '\0';
+			current->cost = current->type = current->mainType = EMPTY_STR;
+			current->power = current->toughness = current->loyalty = EMPTY_STR;
+			current->meta = NULL;
+			current->meta_count = current->meta_cap = 0;
+			text.len = 0;
 			reading_text = 0;
-		} else {
+		} else if (current) {
 			if(line[0] == '\t' && line[1] == '\t') {
 				char key[MAX_LINE], value[MAX_LINE];
 				LOG("Metadata detected\n");
 				if (sscanf(line + 2, "%[^:]: %[^\n]", key, value) == 2) {
-					add_metadata(&current->metadata, key, value, verbose);
+					add_metadata(current, key, value, verbose);
+					STAT_ADD(STAT_METADATA, 1);
 				}
 			} else if (reading_text && strcmp(line, "\tMetadata:\n") != 0) {
 				// If it's part of text, append with a newline for readability
-				strcat(current->text, line + 1);  // Skip the tab character
+				strbuf_append(&text, line + 1, strlen(line + 1));  // Skip the tab character
 				LOGX("Read text: %s\n", line);
 			} else if (sscanf(line, "\t%[^:]: %[^\n]", key, value) == 2) { 
 				if (strcmp(key, "Cost") == 0) {
-					strcpy(current->cost, value);
+					current->cost = set_str(value);
 					LOGX("Cost: %s\n", current->cost);
 					reading_text = 0;
 				} else if (strcmp(key, "Type") == 0) {
-					strcpy(current->type, value);
+					current->type = set_str(value);
 					LOGX("Type: %s\n", current->type);
 					reading_text = 0;
 				} else if (strcmp(key, "MainType") == 0) { 
-					strcpy(current->mainType, value);
+					current->mainType = set_str(value);
 					LOGX("Main type: %s\n", current->mainType);
 					reading_text = 0;  // Ensure text does not start here
 				} else if (strcmp(key, "Power") == 0) {
-					strcpy(current->power, value);
+					current->power = set_str(value);
 					LOGX("Power: %s\n", current->power);
 					reading_text = 0;
 				} else if (strcmp(key, "Toughness") == 0) {
-					strcpy(current->toughness, value);
+					current->toughness = set_str(value);
 					LOGX("Toughness: %s\n", current->toughness);
 					reading_text = 0;
 				} else if (strcmp(key, "Loyalty") == 0) {
-					strcpy(current->loyalty, value);
+					current->loyalty = set_str(value);
 					LOGX("Loyalty: %s\n", current->loyalty);
 					reading_text = 0;
 				}
@@ -260,39 +1235,147 @@ void parse_osmx(const char *filename, int verbose) {
 			}
 		}
 	}
-	fclose(file);
+	if (current) {
+		current->text = arena_str(&set_arena, text.data, text.len);
+		parse_emit(emit, current, ctx, &emit_ns);
+	}
+	free(text.data);
+	// In streaming mode emit() writes and renders: that is not parsing
+	if (stats_enabled) stats_record(TIMER_PARSE, stats_now() - start - emit_ns);
 }
 
-void print_metadata(Metadata *head) {
-	if (!head) {
+void print_metadata(const Entry *entry) {
+	if (!entry->meta_count) {
 		printf("No metadata.\n");
 		return;
 	}
 
 	printf("Metadata:\n");
-	while (head) {
-		printf("\t%s: %s\n", head->key, head->value);
-		head = head->next;
+	for (uint32_t i = 0; i < entry->meta_count; i++) {
+		printf("\t%s: %s\n", meta_keys.strings[entry->meta[i].key], meta_values.strings[entry->meta[i].value]);
 	}
 }
 
-void print_entry(Entry entry) {
+void print_entry(const Entry *entry) {
 	printf("\nEntry: %s\nCost: %s\nType: %s\nMainType: %s\nText: %s\n",
-		entry.name, entry.cost, entry.type, entry.mainType, entry.text);
-	if (strlen(entry.power) > 0 && strlen(entry.toughness) > 0) {
-		printf("Power/Toughness: %s/%s\n", entry.power, entry.toughness);
+		entry->name, entry->cost, entry->type, entry->mainType, entry->text);
+	if (str_len(entry->power) > 0 && str_len(entry->toughness) > 0) {
+		printf("Power/Toughness: %s/%s\n", entry->power, entry->toughness);
+	}
+	if (str_len(entry->loyalty) > 0) {
+		printf("Loyalty: %s\n", entry->loyalty);
+	}
+	print_metadata(entry);
+}
+
+uint32_t trigram(const char *s) {
+	return (uint8_t)tolower((uint8_t)s[0]) | (uint8_t)tolower((uint8_t)s[1]) << 8 | (uint32_t)(uint8_t)tolower((uint8_t)s[2]) << 16;
+}
+
+void index_field(Str field, uint32_t id) {
+	size_t len = str_len(field);
+	for (size_t i = 0; i + 3 <= len; i++) {
+		idlist_insert(idindex_get(&search_index, trigram(field + i), 1), id);
 	}
-	if (strlen(entry.loyalty) > 0) {
-		printf("Loyalty: %s\n", entry.loyalty);
+}
+
+void unindex_field(Str field, uint32_t id) {
+	size_t len = str_len(field);
+	for (size_t i = 0; i + 3 <= len; i++) {
+		IdList *list = idindex_get(&search_index, trigram(field + i), 0);
+		if (list) idlist_remove(list, id);
 	}
-	print_metadata(entry.metadata);
+}
+
+void index_entry(const Entry *entry) {
+	if (!search_indexed) return;
+	index_field(entry->name, entry->id);
+	index_field(entry->text, entry->id);
+}
+
+void unindex_entry(const Entry *entry) {
+	if (!search_indexed) return;
+	unindex_field(entry->name, entry->id);
+	unindex_field(entry->text, entry->id);
+}
+
+// Build the search index over the whole entries table, if no search has yet
+void build_search_index() {
+	if (search_indexed) return;
+	search_indexed = 1;
+	for (int i = 0; i < entry_count; i++) {
+		index_entry(&entries[i]);
+	}
+}
+
+// Replace the name or text of an entry in the table, keeping the search index in sync
+void set_searchable(Entry *entry, Str *field, Str value) {
+	unindex_entry(entry);
+	*field = value;
+	index_entry(entry);
+}
+
+const char *find_ignore_case(const char *haystack, const char *needle) {
+	for (; *haystack; haystack++) {
+		size_t i = 0;
+		while (needle[i] && tolower((uint8_t)haystack[i]) == tolower((uint8_t)needle[i])) i++;
+		if (!needle[i]) return haystack;
+	}
+	return *needle ? NULL : haystack;
+}
+
+int entry_matches(const Entry *entry, const char *query) {
+	if (search_ignore_case) return find_ignore_case(entry->name, query) || find_ignore_case(entry->text, query);
+	return strstr(entry->name, query) || strstr(entry->text, query);
+}
+
+/* The shortest posting list among the query's trigrams, or NULL when the
+   query is too short to use the index. *none is set if some trigram of the
+   query occurs nowhere, in which case nothing can match. */
+IdList *search_candidates(const char *query, int *none) {
+	IdList *best = NULL;
+	*none = 0;
+	build_search_index();
+	for (size_t i = 0; query[i] && query[i + 1] && query[i + 2]; i++) {
+		IdList *list = idindex_get(&search_index, trigram(query + i), 0);
+		if (!list || !list->count) {
+			*none = 1;
+			return NULL;
+		}
+		if (!best || list->count < best->count) best = list;
+	}
+	return best;
+}
+
+// First candidate position whose entry sits at or after index (ids follow table order)
+uint32_t candidate_at(const IdList *list, int index) {
+	uint32_t lo = 0, hi = list->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (entry_slots[list->ids[mid]] < index) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
 }
 
 int search_entries(const char *query, int start_index) {
+	STAT_ADD(STAT_SEARCHES, 1);
+	int none;
+	IdList *list = search_candidates(query, &none);
+	if (none) return -1;
+	if (list) {
+		uint32_t start = candidate_at(list, start_index);
+		for (uint32_t i = 0; i < list->count; i++) {
+			int index = entry_slots[list->ids[(start + i) % list->count]];
+			if (entry_matches(&entries[index], query)) return index;
+		}
+		return -1;
+	}
+
 	for (int i = 0; i < entry_count; i++) {
 		int index = (start_index + i) % entry_count;
 
-		if (strstr(entries[index].name, query) || strstr(entries[index].text, query)) {
+		if (entry_matches(&entries[index], query)) {
 			return index;
 		}
 	}
@@ -301,10 +1384,23 @@ int search_entries(const char *query, int start_index) {
 }
 
 int reverse_search_entries(const char *query, int start_index) {
+	STAT_ADD(STAT_SEARCHES, 1);
+	int none;
+	IdList *list = search_candidates(query, &none);
+	if (none) return -1;
+	if (list) {
+		uint32_t start = candidate_at(list, start_index + 1) + list->count - 1;  // Last candidate at or before start_index
+		for (uint32_t i = 0; i < list->count; i++) {
+			int index = entry_slots[list->ids[(start - i) % list->count]];
+			if (entry_matches(&entries[index], query)) return index;
+		}
+		return -1;
+	}
+
 	for (int i = 0; i < entry_count; i++) {
 		int index = (start_index + entry_count - i) % entry_count;
 
-		if (strstr(entries[index].name, query) || strstr(entries[index].text, query)) {
+		if (entry_matches(&entries[index], query)) {
 			return index;
 		}
 	}
@@ -312,31 +1408,288 @@ int reverse_search_entries(const char *query, int start_index) {
 	return -1;  // No match found
 }
 
-void bulk_replace_text(Entry *entries, int num_entries, const char *old_word, const char *new_word) {
-	for (int i = 0; i < num_entries; i++) {
-		char *pos, buffer[MAX_LINE * 4];  // Buffer to store updated text
-		char *src = entries[i].text;
-		char *dst = buffer;
+/* Bulk replace compiles every find/replace rule into one Aho-Corasick
+   automaton, so each field is scanned once no matter how many rules there
+   are. Matches are taken leftmost-longest and never overlap. */
+enum { FIELD_NAME = 1, FIELD_TYPE = 2, FIELD_TEXT = 4, FIELD_META = 8 };
+
+typedef struct {
+	const char *find, *replace;
+} ReplaceRule;
+
+typedef struct {
+	int32_t (*next)[256];  // Complete transition table
+	int32_t *fail, *depth, *match;  // match: longest rule ending in this state, or -1
+	int count, cap;
+	const ReplaceRule *rules;
+	size_t *find_len, *replace_len;
+} Automaton;
+
+int automaton_node(Automaton *ac, int depth) {
+	if (ac->count == ac->cap) {
+		ac->cap = ac->cap ? ac->cap * 2 : 64;
+		ac->next = realloc(ac->next, ac->cap * sizeof(*ac->next));
+		ac->fail = realloc(ac->fail, ac->cap * sizeof(int32_t));
+		ac->depth = realloc(ac->depth, ac->cap * sizeof(int32_t));
+		ac->match = realloc(ac->match, ac->cap * sizeof(int32_t));
+		if (!ac->next || !ac->fail || !ac->depth || !ac->match) {
+			perror("Cannot grow automaton");
+			exit(1);
+		}
+	}
+	memset(ac->next[ac->count], -1, sizeof(*ac->next));
+	ac->fail[ac->count] = 0;
+	ac->depth[ac->count] = depth;
+	ac->match[ac->count] = -1;
+	return ac->count++;
+}
+
+void build_automaton(Automaton *ac, const ReplaceRule *rules, int rule_count) {
+	*ac = (Automaton){ 0 };
+	ac->rules = rules;
+	ac->find_len = malloc(rule_count * sizeof(size_t));
+	ac->replace_len = malloc(rule_count * sizeof(size_t));
+	automaton_node(ac, 0);
+	for (int r = 0; r < rule_count; r++) {
+		ac->find_len[r] = strlen(rules[r].find);
+		ac->replace_len[r] = strlen(rules[r].replace);
+		if (ac->find_len[r] == 0) continue;
+		int state = 0;
+		for (const char *c = rules[r].find; *c; c++) {
+			if (ac->next[state][(uint8_t)*c] < 0) {
+				int node = automaton_node(ac, ac->depth[state] + 1);
+				ac->next[state][(uint8_t)*c] = node;
+			}
+			state = ac->next[state][(uint8_t)*c];
+		}
+		if (ac->match[state] < 0) ac->match[state] = r;  // The first of duplicate rules wins
+	}
+
+	// Breadth-first: fill in failure links and turn the trie into a complete DFA
+	int *queue = malloc(ac->count * sizeof(int)), head = 0, tail = 0;
+	for (int c = 0; c < 256; c++) {
+		int child = ac->next[0][c];
+		if (child < 0) {
+			ac->next[0][c] = 0;
+		} else {
+			queue[tail++] = child;
+		}
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		if (ac->match[state] < 0) ac->match[state] = ac->match[ac->fail[state]];
+		for (int c = 0; c < 256; c++) {
+			int child = ac->next[state][c];
+			if (child < 0) {
+				ac->next[state][c] = ac->next[ac->fail[state]][c];
+			} else {
+				ac->fail[child] = ac->next[ac->fail[state]][c];
+				queue[tail++] = child;
+			}
+		}
+	}
+	free(queue);
+}
+
+void free_automaton(Automaton *ac) {
+	free(ac->next);
+	free(ac->fail);
+	free(ac->depth);
+	free(ac->match);
+	free(ac->find_len);
+	free(ac->replace_len);
+}
 
-		while ((pos = strstr(src, old_word))) {
-			size_t len_before = pos - src;
-			strncpy(dst, src, len_before);
-			dst += len_before;
-			strcpy(dst, new_word);
-			dst += strlen(new_word);
-			src = pos + strlen(old_word);
+// Apply every rule to s in one pass. Returns the number of replacements; out is only written if that is not 0
+int apply_automaton(const Automaton *ac, const char *s, size_t len, StrBuf *out) {
+	int replaced = 0, best = -1, state = 0;
+	size_t copied = 0, best_start = 0;
+	out->len = 0;
+	for (size_t j = 0; j <= len; j++) {
+		if (j < len) {
+			state = ac->next[state][(uint8_t)s[j]];
+			int rule = ac->match[state];
+			if (rule >= 0) {
+				size_t start = j + 1 - ac->find_len[rule];
+				if (best < 0 || start <= best_start) {  // Same start means a longer match
+					best = rule;
+					best_start = start;
+				}
+			}
+			// Keep scanning while a longer match could still start at or before best_start
+			if (best < 0 || j + 1 - ac->depth[state] <= best_start) continue;
+		} else if (best < 0) {
+			break;
 		}
-		strcpy(dst, src);  // Copy remaining text
-		strcpy(entries[i].text, buffer); // Save changes
+		strbuf_append(out, s + copied, best_start - copied);
+		strbuf_append(out, ac->rules[best].replace, ac->replace_len[best]);
+		copied = best_start + ac->find_len[best];
+		replaced++;
+		best = -1;
+		state = 0;
+		j = copied - 1;  // Resume right after the match
+	}
+	if (replaced) strbuf_append(out, s + copied, len - copied);
+	return replaced;
+}
+
+/* Undo log: a bulk replace only swaps Str handles (and metadata value ids),
+   and the old strings stay in the set arena, so undoing it just needs the
+   previous handles. Each batch is a contiguous run of records. */
+typedef struct {
+	uint32_t id;  // Entry id
+	uint16_t field;  // FIELD_* or FIELD_META with key
+	uint32_t key;
+	union {
+		Str old;
+		uint32_t old_value;
+	};
+} UndoRecord;
+
+struct {
+	UndoRecord *records;
+	uint32_t count, cap;
+	uint32_t *batches;  // Start of every batch in records
+	uint32_t batch_count, batch_cap;
+} undo_log;
+
+void log_undo(UndoRecord record) {
+	if (undo_log.count == undo_log.cap) {
+		undo_log.records = grow_array(undo_log.records, &undo_log.cap, sizeof(UndoRecord), 64);
+	}
+	undo_log.records[undo_log.count++] = record;
+}
+
+Str *entry_field(Entry *entry, int field) {
+	if (field == FIELD_NAME) return &entry->name;
+	if (field == FIELD_TYPE) return &entry->type;
+	return &entry->text;
+}
+
+typedef struct {
+	const Automaton *ac;
+	int fields;
+	Str *results;  // 3 per entry: new name, type and text, NULL if unchanged
+	int counts[MAX_WORKERS];
+} ReplaceJob;
+
+Arena worker_arenas[MAX_WORKERS];  // Strings built by workers, merged into the set arena afterwards
+StrBuf worker_buffers[MAX_WORKERS];
+
+void replace_task(int task, int worker, void *ctx) {
+	ReplaceJob *job = ctx;
+	const int fields[3] = { FIELD_NAME, FIELD_TYPE, FIELD_TEXT };
+	for (int f = 0; f < 3; f++) {
+		job->results[3 * task + f] = NULL;
+		if (!(job->fields & fields[f])) continue;
+		Str value = *entry_field(&entries[task], fields[f]);
+		StrBuf *out = &worker_buffers[worker];
+		int replaced = apply_automaton(job->ac, value, str_len(value), out);
+		if (!replaced) continue;
+		job->results[3 * task + f] = arena_str(&worker_arenas[worker], out->data, out->len);
+		job->counts[worker] += replaced;
 	}
 }
 
+// Apply all rules to the chosen fields of every entry as one undoable batch. Returns the number of replacements
+int bulk_replace(const ReplaceRule *rules, int rule_count, int fields) {
+	Automaton ac;
+	build_automaton(&ac, rules, rule_count);
+	ReplaceJob job = { &ac, fields, malloc(3 * (size_t)entry_count * sizeof(Str) + 1) };
+	if (!job.results) {
+		perror("Cannot allocate bulk replace");
+		exit(1);
+	}
+	pool_run(entry_count, replace_task, &job);
+	for (int w = 0; w < pool_size(); w++) {
+		arena_merge(&set_arena, &worker_arenas[w]);
+	}
+
+	if (undo_log.batch_count == undo_log.batch_cap) {
+		undo_log.batches = grow_array(undo_log.batches, &undo_log.batch_cap, sizeof(uint32_t), 8);
+	}
+	undo_log.batches[undo_log.batch_count++] = undo_log.count;
+
+	int total = 0;
+	for (int w = 0; w < pool_size(); w++) {
+		total += job.counts[w];
+	}
+	const int text_fields[3] = { FIELD_NAME, FIELD_TYPE, FIELD_TEXT };
+	for (int i = 0; i < entry_count; i++) {
+		for (int f = 0; f < 3; f++) {
+			Str value = job.results[3 * i + f];
+			if (!value) continue;
+			Str *field = entry_field(&entries[i], text_fields[f]);
+			log_undo((UndoRecord){ .id = entries[i].id, .field = text_fields[f], .old = *field });
+			if (text_fields[f] == FIELD_TYPE) *field = value;
+			else set_searchable(&entries[i], field, value);
+		}
+	}
+	free(job.results);
+
+	// Metadata values are pooled, so every distinct value only has to be rewritten once
+	if (fields & FIELD_META) {
+		uint32_t value_count = meta_values.count;
+		int32_t *remap = malloc(value_count * sizeof(int32_t) + 1);
+		StrBuf *out = &worker_buffers[0];
+		for (uint32_t v = 0; v < value_count; v++) {
+			Str value = meta_values.strings[v];
+			int replaced = apply_automaton(&ac, value, str_len(value), out);
+			remap[v] = replaced ? (int32_t)intern(&meta_values, &set_arena, out->data, out->len) : -1;
+		}
+		for (int i = 0; i < entry_count; i++) {
+			Entry *entry = &entries[i];
+			for (uint32_t p = 0; p < entry->meta_count; p++) {
+				int32_t value = remap[entry->meta[p].value];
+				if (value < 0) continue;
+				log_undo((UndoRecord){ .id = entry->id, .field = FIELD_META, .key = entry->meta[p].key, .old_value = entry->meta[p].value });
+				unindex_metadata(entry);
+				entry->meta[p].value = value;
+				index_metadata(entry);
+				total++;
+			}
+		}
+		free(remap);
+	}
+	free_automaton(&ac);
+	STAT_ADD(STAT_REPLACEMENTS, total);
+	return total;
+}
+
+void clear_undo_log() {
+	undo_log.count = undo_log.batch_count = 0;
+}
+
+// Revert the last bulk replace. Returns 0 if there was nothing to undo
+int undo_bulk_replace() {
+	if (!undo_log.batch_count) return 0;
+	uint32_t start = undo_log.batches[--undo_log.batch_count];
+	while (undo_log.count > start) {
+		UndoRecord *record = &undo_log.records[--undo_log.count];
+		if (entry_slots[record->id] < 0) continue;  // Rejected since
+		Entry *entry = &entries[entry_slots[record->id]];
+		if (record->field == FIELD_META) {
+			for (uint32_t p = 0; p < entry->meta_count; p++) {
+				if (entry->meta[p].key != record->key) continue;
+				unindex_metadata(entry);
+				entry->meta[p].value = record->old_value;
+				index_metadata(entry);
+			}
+		} else if (record->field == FIELD_TYPE) {
+			entry->type = record->old;
+		} else {
+			set_searchable(entry, entry_field(entry, record->field), record->old);
+		}
+	}
+	return 1;
+}
+
 void prompt_user() {
 	int i = 0;
 	char last_search[MAX_LINE];
 	while(1) {
-		print_entry(entries[i]);
-		printf("(A)pprove, (R)eject, (E)dit, (S)earch, (Q)uit editor, (B)ulk replace, (M)etadata edit? ");
+		print_entry(&entries[i]);
+		printf("(A)pprove, (R)eject, (E)dit, (S)earch, (Q)uit editor, (B)ulk replace, (U)ndo replace, (M)etadata edit, (F)ind by metadata, (I)gnore case? ");
 		char choice;
 		scanf(" %c", &choice);
 		getchar();
@@ -356,10 +1709,14 @@ void prompt_user() {
 			case 'R':
 			case 'r':
 				printf("Entry rejected.\n");
-				for (int j = i; j < entry_count - 1; j++) {
-					entries[j] = entries[j + 1];
-				}
+				unindex_metadata(&entries[i]);
+				unindex_entry(&entries[i]);
+				entry_slots[entries[i].id] = -1;
+				memmove(&entries[i], &entries[i + 1], (entry_count - i - 1) * sizeof(Entry));
 				entry_count--;
+				for (int j = i; j < entry_count; j++) {
+					entry_slots[entries[j].id] = j;
+				}
 				break;
 			case 'E':
 			case 'e':
@@ -369,40 +1726,45 @@ void prompt_user() {
 					scanf(" %c", &edit_choice);
 					getchar();
 					char buffer[MAX_LINE];
+					Str *field = NULL;
 					
 					if (edit_choice == 'N' || edit_choice == 'n') {
-						fgets(entries[i].name, MAX_LINE, stdin);
+						field = &entries[i].name;
 					} else if (edit_choice == 'C' || edit_choice == 'c') {
-						fgets(entries[i].cost, MAX_LINE, stdin);
+						field = &entries[i].cost;
 					} else if (edit_choice == 'T' || edit_choice == 't') {
-						fgets(entries[i].type, MAX_LINE, stdin);
+						field = &entries[i].type;
 					} else if (edit_choice == 'M' || edit_choice == 'm') {
-						fgets(entries[i].mainType, MAX_LINE, stdin);
+						field = &entries[i].mainType;
 					} else if (edit_choice == 'P' || edit_choice == 'p') {
-						fgets(entries[i].power, MAX_LINE, stdin);
+						field = &entries[i].power;
 					} else if (edit_choice == 'U' || edit_choice == 'u') {
-						fgets(entries[i].toughness, MAX_LINE, stdin);
+						field = &entries[i].toughness;
 					} else if (edit_choice == 'L' || edit_choice == 'l') {
-						fgets(entries[i].loyalty, MAX_LINE, stdin);
+						field = &entries[i].loyalty;
 					} else if (edit_choice == 'X' || edit_choice == 'x') {
 						printf("Enter new Text. Type 'exit' or an empty line twice to finish:\n");
-						entries[i].text[0] = '\0';
+						StrBuf text = { 0 };
 						while (1) {
-							fgets(buffer, MAX_LINE, stdin);
-							if (strcmp(buffer, "exit\n") == 0) break;
+							if (!fgets(buffer, MAX_LINE, stdin) || strcmp(buffer, "exit\n") == 0) break;
 							if (buffer[0] == '\n') {
-								fgets(buffer, MAX_LINE, stdin);
-								if (buffer[0] == '\n') break;
-								strcat(entries[i].text, "\n");
+								if (!fgets(buffer, MAX_LINE, stdin) || buffer[0] == '\n') break;
+								strbuf_append(&text, "\n", 1);
 							}
-							strcat(entries[i].text, buffer);
+							strbuf_append(&text, buffer, strlen(buffer));
 						}
+						set_searchable(&entries[i], &entries[i].text, arena_str(&set_arena, text.data, text.len));
+						free(text.data);
 					} else if (edit_choice == 'V' || edit_choice == 'v') {
-						print_entry(entries[i]);
+						print_entry(&entries[i]);
 					} else if (edit_choice == 'D' || edit_choice == 'd') {
 						++i;
 						break;
 					}
+					if (field && fgets(buffer, MAX_LINE, stdin)) {
+						if (field == &entries[i].name) set_searchable(&entries[i], field, set_str(buffer));
+						else *field = set_str(buffer);
+					}
 				}
 				break;
 			case 'S':
@@ -430,19 +1792,80 @@ void prompt_user() {
 				break;
 			case 'B':
 			case 'b':
-				char old_word[MAX_LINE], new_word[MAX_LINE];
+				ReplaceRule *rules = NULL;
+				uint32_t rule_count = 0, rule_cap = 0;
+				char find[MAX_LINE], replace[MAX_LINE], field_choice[MAX_LINE];
 
-				printf("Find: ");
-				fgets(old_word, MAX_LINE, stdin);
-				old_word[strcspn(old_word, "\n")] = '\0'; // Remove newline
+				while (1) {
+					printf("Find (empty line to finish): ");
+					if (!fgets(find, MAX_LINE, stdin) || find[0] == '\n') break;
+					find[strcspn(find, "\n")] = '\0'; // Remove newline
+
+					printf("Replace with: ");
+					if (!fgets(replace, MAX_LINE, stdin)) break;
+					replace[strcspn(replace, "\n")] = '\0'; // Remove newline
+
+					if (rule_count == rule_cap) rules = grow_array(rules, &rule_cap, sizeof(ReplaceRule), 8);
+					rules[rule_count++] = (ReplaceRule){ strdup(find), strdup(replace) };
+				}
+				if (!rule_count) break;
 
-				printf("Replace with: ");
-				fgets(new_word, MAX_LINE, stdin);
-				new_word[strcspn(new_word, "\n")] = '\0'; // Remove newline
+				printf("In fields, any of (N)ame, (T)ype, Te(X)t, (M)etadata [X]: ");
+				if (!fgets(field_choice, MAX_LINE, stdin)) field_choice[0] = '\0';
+				int fields = 0;
+				for (char *c = field_choice; *c; c++) {
+					switch (tolower((uint8_t)*c)) {
+						case 'n': fields |= FIELD_NAME; break;
+						case 't': fields |= FIELD_TYPE; break;
+						case 'x': fields |= FIELD_TEXT; break;
+						case 'm': fields |= FIELD_META; break;
+					}
+				}
+				if (!fields) fields = FIELD_TEXT;
 
-				bulk_replace_text(entries, entry_count, old_word, new_word);
-				printf("Replaced all occurrences of '%s' with '%s'.\n", old_word, new_word);
+				int replaced = bulk_replace(rules, rule_count, fields);
+				for (uint32_t r = 0; r < rule_count; r++) {
+					free((char *)rules[r].find);
+					free((char *)rules[r].replace);
+				}
+				free(rules);
+				printf("Replaced %d occurrences of %u patterns. (U)ndo reverts this.\n", replaced, rule_count);
+				break;
+			case 'U':
+			case 'u':
+				if (undo_bulk_replace()) printf("Bulk replace undone.\n");
+				else printf("Nothing to undo.\n");
 				break;
+			case 'I':
+			case 'i':
+				search_ignore_case = !search_ignore_case;
+				printf("Search is now case-%s.\n", search_ignore_case ? "insensitive" : "sensitive");
+				break;
+			case 'F':
+			case 'f': {
+				char key[MAX_LINE], value[MAX_LINE];
+				const uint32_t *ids;
+				printf("Enter metadata key: ");
+				fgets(key, MAX_LINE, stdin);
+				key[strcspn(key, "\n")] = '\0';
+
+				printf("Enter value: ");
+				fgets(value, MAX_LINE, stdin);
+				value[strcspn(value, "\n")] = '\0';
+
+				STAT_ADD(STAT_SEARCHES, 1);
+				uint32_t count = find_metadata(key, value, &ids);
+				if (count == 0) {
+					printf("No matching entries found.\n");
+					break;
+				}
+				// Ids are in table order, so jump to the first match after the current entry
+				uint32_t next = 0;
+				while (next < count && entry_slots[ids[next]] <= i) next++;
+				i = entry_slots[ids[next < count ? next : 0]];
+				printf("%u entries have %s: %s.\n", count, key, value);
+				break;
+			}
 			case 'M':
 			case 'm':
 					char key[MAX_LINE], value[MAX_LINE];
@@ -454,53 +1877,592 @@ void prompt_user() {
 					fgets(value, MAX_LINE, stdin);
 					value[strcspn(value, "\n")] = '\0';
 
-					if (get_metadata(entries[i].metadata, key)) {
-						edit_metadata(entries[i].metadata, key, value);
-					} else {
-						add_metadata(&entries[i].metadata, key, value, 0);
-					}
+					edit_metadata(&entries[i], key, value);
 		}
 	}
 }
 
-void write_xml(FILE *file, const char *set_name, const char *longname, const char *release_date, int verbose) {
-	fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-	fprintf(file, "<cockatrice_carddatabase version=\"4\">\n");
-	fprintf(file, "  <sets>\n  <set>\n");
-	fprintf(file, "  <name>%s</name>\n", set_name);
-	fprintf(file, "  <longname>%s</longname>\n", longname);
-	fprintf(file, "  <settype>Custom</settype>\n");
-	fprintf(file, "  <releasedate>%s</releasedate>\n", release_date);
-	fprintf(file, "</set>\n  </sets>\n  <cards>\n");
-	
-	for (int i = 0; i < entry_count; i++) {
-		fprintf(file, "  <card>\n");
-		fprintf(file, "	<name>%s</name>\n", entries[i].name);
-		fprintf(file, "	<text>%s</text>\n", entries[i].text);
-		fprintf(file, "	<prop>\n");
-		fprintf(file, "	  <type>%s</type>\n", entries[i].type);
-		fprintf(file, "	  <maintype>%s</maintype>\n", entries[i].mainType);
-		fprintf(file, "	  <manacost>%s</manacost>\n", entries[i].cost);
-		fprintf(file, "	  <cmc>%d</cmc>\n", calculate_cmc(entries[i].cost, verbose));
-		char colors[MAX_LINE] = "";
-		get_unique_colors(entries[i].cost, colors, verbose);
-		fprintf(file, "	  <colors>%s</colors>\n", colors);
-		fprintf(file, "	  <coloridentity>%s</coloridentity>\n", colors);
-		if (strlen(entries[i].power) > 0 && strlen(entries[i].toughness) > 0) {
-			fprintf(file, "	  <pt>%s/%s</pt>\n", entries[i].power, entries[i].toughness);
-		}
-		if (strlen(entries[i].loyalty) > 0) {
-			fprintf(file, "	  <loyalty>%s</loyalty>\n", entries[i].loyalty);
-		}
-		fprintf(file, "	</prop>\n");
-		fprintf(file, "    <set>%s</set>\n", set_name);
-		fprintf(file, "  </card>\n");
+/* XML export. Cards are formatted in parallel, a chunk of XML_CHUNK cards
+   per task, into the buffer of the worker that runs the task. The chunks
+   are then written in card order with writev, straight from those
+   buffers. */
+#define XML_CHUNK 64
+#ifndef IOV_MAX
+#define IOV_MAX 1024  // POSIX only guarantees 16, Linux allows 1024
+#endif
+
+// Append s to out, replacing the characters XML does not allow in text with entities
+void strbuf_escape(StrBuf *out, const char *s, size_t len) {
+	size_t i = 0, run = 0;
+#ifdef __SSE2__
+	const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+#endif
+	while (i < len) {
+#ifdef __SSE2__
+		while (i + 16 <= len) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+			int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)), _mm_cmpeq_epi8(v, gt)));
+			if (mask) {
+				i += __builtin_ctz(mask);
+				break;
+			}
+			i += 16;
+		}
+#endif
+		while (i < len && s[i] != '&' && s[i] != '<' && s[i] != '>') i++;
+		strbuf_append(out, s + run, i - run);
+		if (i == len) break;
+		if (s[i] == '&') strbuf_append(out, "&amp;", 5);
+		else if (s[i] == '<') strbuf_append(out, "&lt;", 4);
+		else strbuf_append(out, "&gt;", 4);
+		run = ++i;
+	}
+}
+
+// Length of s without trailing whitespace, such as the newline names keep from the .osmx
+size_t trimmed_len(Str s) {
+	size_t len = str_len(s);
+	while (len > 0 && isspace((uint8_t)s[len - 1])) len--;
+	return len;
+}
+
+void strbuf_puts(StrBuf *out, const char *s) {
+	strbuf_append(out, s, strlen(s));
+}
+
+// Append open, the escaped field and close
+void strbuf_element(StrBuf *out, const char *open, Str field, size_t len, const char *close) {
+	strbuf_puts(out, open);
+	strbuf_escape(out, field, len);
+	strbuf_puts(out, close);
+}
+
+void format_xml_header(StrBuf *out, const char *set_name, const char *longname, const char *release_date) {
+	strbuf_puts(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	strbuf_puts(out, "<cockatrice_carddatabase version=\"4\">\n");
+	strbuf_puts(out, "  <sets>\n  <set>\n");
+	strbuf_puts(out, "  <name>");
+	strbuf_escape(out, set_name, strlen(set_name));
+	strbuf_puts(out, "</name>\n  <longname>");
+	strbuf_escape(out, longname, strlen(longname));
+	strbuf_puts(out, "</longname>\n  <settype>Custom</settype>\n  <releasedate>");
+	strbuf_escape(out, release_date, strcspn(release_date, "\n"));
+	strbuf_puts(out, "</releasedate>\n</set>\n  </sets>\n  <cards>\n");
+}
+
+#define XML_FOOTER "  </cards>\n</cockatrice_carddatabase>\n"
+
+void format_card(StrBuf *out, const Entry *entry, const char *set_name, int verbose) {
+	char number[16], colors[8] = "";
+	strbuf_element(out, "  <card>\n\t<name>", entry->name, trimmed_len(entry->name), "</name>\n");
+	strbuf_element(out, "\t<text>", entry->text, str_len(entry->text), "</text>\n\t<prop>\n");
+	strbuf_element(out, "\t  <type>", entry->type, trimmed_len(entry->type), "</type>\n");
+	strbuf_element(out, "\t  <maintype>", entry->mainType, trimmed_len(entry->mainType), "</maintype>\n");
+	strbuf_element(out, "\t  <manacost>", entry->cost, trimmed_len(entry->cost), "</manacost>\n");
+	snprintf(number, sizeof(number), "%d", calculate_cmc(entry->cost, verbose));
+	strbuf_puts(out, "\t  <cmc>");
+	strbuf_puts(out, number);
+	strbuf_puts(out, "</cmc>\n");
+	get_unique_colors(entry->cost, colors, verbose);
+	strbuf_puts(out, "\t  <colors>");
+	strbuf_puts(out, colors);
+	strbuf_puts(out, "</colors>\n\t  <coloridentity>");
+	strbuf_puts(out, colors);
+	strbuf_puts(out, "</coloridentity>\n");
+	if (str_len(entry->power) > 0 && str_len(entry->toughness) > 0) {
+		strbuf_element(out, "\t  <pt>", entry->power, trimmed_len(entry->power), "/");
+		strbuf_escape(out, entry->toughness, trimmed_len(entry->toughness));
+		strbuf_puts(out, "</pt>\n");
+	}
+	if (str_len(entry->loyalty) > 0) {
+		strbuf_element(out, "\t  <loyalty>", entry->loyalty, trimmed_len(entry->loyalty), "</loyalty>\n");
+	}
+	strbuf_puts(out, "\t</prop>\n    <set>");
+	strbuf_escape(out, set_name, strlen(set_name));
+	strbuf_puts(out, "</set>\n  </card>\n");
+}
+
+typedef struct {
+	const Entry *list;
+	int count;
+	const char *set_name;
+	int verbose;
+	struct {
+		int worker;
+		size_t offset, len;
+	} *chunks;
+} XmlJob;
+
+StrBuf xml_buffers[MAX_WORKERS];  // Reused by every export
+
+void xml_task(int task, int worker, void *ctx) {
+	XmlJob *job = ctx;
+	StrBuf *out = &xml_buffers[worker];
+	size_t offset = out->len;
+	int end = (task + 1) * XML_CHUNK < job->count ? (task + 1) * XML_CHUNK : job->count;
+	for (int i = task * XML_CHUNK; i < end; i++) {
+		format_card(out, &job->list[i], job->set_name, job->verbose);
+	}
+	job->chunks[task].worker = worker;
+	job->chunks[task].offset = offset;
+	job->chunks[task].len = out->len - offset;
+}
+
+int writev_all(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Write prefix, the <card> elements of list and suffix to fd. prefix and
+   suffix may be NULL. Returns 0 on success, -1 with errno set on failure. */
+int write_cards(int fd, const char *prefix, size_t prefix_len, const Entry *list, int count, const char *set_name, const char *suffix, int verbose) {
+	STAT_START(start);
+	int chunk_count = (count + XML_CHUNK - 1) / XML_CHUNK;
+	XmlJob job = { list, count, set_name, verbose, malloc((chunk_count + 1) * sizeof(*job.chunks)) };
+	struct iovec *iov = malloc((chunk_count + 2) * sizeof(struct iovec));
+	if (!job.chunks || !iov) {
+		perror("Cannot allocate XML export");
+		exit(1);
+	}
+	for (int w = 0; w < pool_size(); w++) {
+		xml_buffers[w].len = 0;
+	}
+	pool_run(chunk_count, xml_task, &job);
+
+	int n = 0;
+	if (prefix) iov[n++] = (struct iovec){ (void *)prefix, prefix_len };
+	for (int c = 0; c < chunk_count; c++) {
+		iov[n++] = (struct iovec){ xml_buffers[job.chunks[c].worker].data + job.chunks[c].offset, job.chunks[c].len };
+	}
+	if (suffix) iov[n++] = (struct iovec){ (void *)suffix, strlen(suffix) };
+	for (int i = 0; i < n; i++) STAT_ADD(STAT_XML_BYTES, iov[i].iov_len);
+	int result = writev_all(fd, iov, n);
+	free(job.chunks);
+	free(iov);
+	STAT_STOP(TIMER_XML, start);
+	return result;
+}
+
+// Export every entry as a Cockatrice set and close file. Returns 0 on success, -1 with errno set on failure
+int write_xml(FILE *file, const char *set_name, const char *longname, const char *release_date, int verbose) {
+	StrBuf header = { 0 };
+	format_xml_header(&header, set_name, longname, release_date);
+	fflush(file);
+	int result = write_cards(fileno(file), header.data, header.len, entries, entry_count, set_name, XML_FOOTER, verbose);
+	free(header.data);
+	if (file == stdout) log_before_stdout_close();
+	if (fclose(file) != 0) result = -1;
+	return result;
+}
+
+typedef struct {
+	int fd;  // -1 when no XML is written
+	const char *set_name;
+	int render, verbose, failures;
+	int xml_error;  // errno of the first failed XML write, 0 if none
+	Atlas *atlas;  // Where cards are rendered in atlas mode
+} StreamContext;
+
+// Write and render the buffered entries, then drop them
+void flush_stream(StreamContext *stream) {
+	if (stream->fd >= 0 && write_cards(stream->fd, NULL, 0, entries, entry_count, stream->set_name, NULL, stream->verbose) != 0) {
+		stream->xml_error = errno;
+		stream->fd = -1;
+	}
+	if (stream->atlas) atlas_add(stream->atlas, entries, entry_count);
+	else if (stream->render) stream->failures += render_entries(entries, entry_count, 0);
+	reset_set();
+}
+
+void stream_entry(Entry *entry, void *ctx) {
+	collect_entry(entry, NULL);
+	if (entry_count == STREAM_BATCH) flush_stream(ctx);
+}
+
+/* Convert input without ever holding more than STREAM_BATCH entries: every
+   entry is written to out (if not NULL, which is closed afterwards) and
+   optionally rendered as soon as its batch is full. Returns the number of
+   cards that could not be rendered, plus one if the XML could not be
+   written. */
+int stream_osmx(FILE *input, FILE *out, const char *set_name, const char *longname, const char *release_date, int render, int verbose) {
+	StreamContext stream = { out ? fileno(out) : -1, set_name, render, verbose, 0, 0, NULL };
+	if (render && atlas_flag) stream.atlas = atlas_open(set_name);
+	StrBuf header = { 0 };
+	format_xml_header(&header, set_name, longname, release_date);
+	if (out) fflush(out);
+	if (stream.fd >= 0 && write_all(stream.fd, (const uint8_t *)header.data, header.len) != 0) {
+		stream.xml_error = errno;
+		stream.fd = -1;
+	}
+	free(header.data);
+	parse_osmx_stream(input, stream_entry, &stream, verbose);
+	flush_stream(&stream);
+	if (stream.atlas) stream.failures += atlas_close(stream.atlas);
+	else if (render) render_cache_save();
+	if (stream.fd >= 0 && write_all(stream.fd, (const uint8_t *)XML_FOOTER, strlen(XML_FOOTER)) != 0) {
+		stream.xml_error = errno;
+	}
+	if (out == stdout) log_before_stdout_close();
+	if (out && fclose(out) != 0 && !stream.xml_error) stream.xml_error = errno;
+	if (stream.xml_error) {
+		fprintf(stderr, "Cannot write XML: %s\n", strerror(stream.xml_error));
+		stream.failures++;
+	}
+	return stream.failures;
+}
+
+/* Batch mode converts many sets in one process, without prompts. Sets come
+   from several -i options or from a manifest with one tab-separated line
+   per set: input, output, set name, long name and release date, where
+   everything after the input may be left empty. */
+void add_set(SetJob **sets, uint32_t *count, uint32_t *cap, const SetJob *set) {
+	if (*count == *cap) *sets = grow_array(*sets, cap, sizeof(SetJob), 16);
+	(*sets)[(*count)++] = *set;
+}
+
+void read_manifest(const char *filename, SetJob **sets, uint32_t *count, uint32_t *cap) {
+	FILE *file = fopen(filename, "r");
+	if (!file) {
+		perror("Error opening manifest");
+		exit(1);
+	}
+	char line[MAX_LINE * 4];
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#') continue;
+		SetJob set = { 0 };
+		char *fields[5] = { set.input, set.output, set.set_name, set.longname, set.release_date };
+		char *cursor = line;
+		for (int f = 0; f < 5 && cursor; f++) {
+			char *tab = strchr(cursor, '\t');
+			if (tab) *tab = '\0';
+			size_t len = strlen(cursor);
+			if (len >= MAX_LINE) len = MAX_LINE - 1;
+			memcpy(fields[f], cursor, len);
+			fields[f][len] = '\0';
+			cursor = tab ? tab + 1 : NULL;
+		}
+		add_set(sets, count, cap, &set);
 	}
-	
-	fprintf(file, "  </cards>\n</cockatrice_carddatabase>\n");
 	fclose(file);
 }
 
+// Fill in whatever the command line or manifest left out, derived from the input name
+void complete_set(SetJob *set) {
+	const char *base = strrchr(set->input, '/');
+	base = base ? base + 1 : set->input;
+	const char *ext = strrchr(base, '.');
+	int stem = ext && ext != base ? ext - base : (int)strlen(base);  // Only the last extension is dropped
+	if (!set->output[0]) snprintf(set->output, MAX_LINE, "%.*s.xml", (int)(base - set->input) + stem, set->input);
+	if (!set->set_name[0]) snprintf(set->set_name, MAX_LINE, "%.*s", stem, base);
+	if (!set->longname[0]) strcpy(set->longname, set->set_name);
+	if (!set->release_date[0]) today(set->release_date);
+}
+
+// Returns the number of sets that failed
+int run_batch(SetJob *sets, uint32_t count, int output_flag, int render, int verbose) {
+	int failed = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		SetJob *set = &sets[i];
+		complete_set(set);
+		fprintf(stderr, " >> %s -> %s\n", set->input, output_flag == 0 ? set->output : output_flag == 1 ? "stdout" : "none");
+		struct stat in_stat, out_stat;
+		if (output_flag == 0 && stat(set->input, &in_stat) == 0 && stat(set->output, &out_stat) == 0
+				&& in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+			fprintf(stderr, "Not converting %s: its output would overwrite it\n", set->input);
+			failed++;
+			continue;
+		}
+		FILE *input = fopen(set->input, "r");
+		if (!input) {
+			fprintf(stderr, "Cannot open %s: %s\n", set->input, strerror(errno));
+			failed++;
+			continue;
+		}
+		FILE *out = NULL;
+		if (output_flag == 0 && !(out = fopen(set->output, "w"))) {
+			fprintf(stderr, "Cannot open %s: %s\n", set->output, strerror(errno));
+			fclose(input);
+			failed++;
+			continue;
+		}
+		if (output_flag == 1) {
+			fflush(stdout);
+			out = fdopen(dup(STDOUT_FILENO), "w");
+		}
+		if (stream_osmx(input, out, set->set_name, set->longname, set->release_date, render, verbose) != 0) failed++;
+		fclose(input);
+	}
+	fprintf(stderr, "Converted %u sets, %d failed.\n", count - failed, failed);
+	return failed;
+}
+
+/* Watch mode keeps the set resident and converts it again whenever the
+   input is saved. The file is cut into blocks at the same line boundaries
+   the parser starts a new entry at, so a block that is byte for byte the
+   same as one of the previous version yields the same entry: its parsed
+   entry and its <card> fragment are reused, and only the other blocks are
+   parsed, formatted and rendered. */
+typedef struct {
+	uint32_t hash;
+	size_t offset, len;  // Block in the current file contents
+	Entry entry;
+	StrBuf xml;  // <card> fragment
+} WatchCard;
+
+typedef struct {
+	const char *input, *output;
+	const char *set_name;
+	StrBuf header;
+	char *data;  // Current file contents
+	size_t size;
+	WatchCard *cards;
+	uint32_t count, cap;
+	uint32_t reparsed;  // Entries parsed since the arena was last emptied
+	int render, verbose;
+} WatchSet;
+
+char *read_file(const char *filename, size_t *size) {
+	FILE *file = fopen(filename, "r");
+	if (!file) return NULL;
+	StrBuf data = { 0 };
+	char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) strbuf_append(&data, chunk, n);
+	int failed = ferror(file);
+	fclose(file);
+	if (failed) {
+		free(data.data);
+		return NULL;
+	}
+	if (!data.data) strbuf_append(&data, "", 0);
+	*size = data.len;
+	return data.data;
+}
+
+// Line length as fgets(MAX_LINE) would read it
+size_t fgets_len(const char *s, size_t size) {
+	size_t max = size < MAX_LINE - 1 ? size : MAX_LINE - 1;
+	const char *nl = memchr(s, '\n', max);
+	return nl ? (size_t)(nl - s) + 1 : max;
+}
+
+void watch_emit(Entry *entry, void *ctx) {
+	*(Entry *)ctx = *entry;
+}
+
+void watch_parse(WatchSet *set, WatchCard *card) {
+	FILE *block = fmemopen(set->data + card->offset, card->len, "r");
+	if (!block) {
+		perror("Cannot parse block");
+		exit(1);
+	}
+	parse_osmx_stream(block, watch_emit, &card->entry, set->verbose);
+	fclose(block);
+	set->reparsed++;
+}
+
+void watch_format_task(int task, int worker, void *ctx) {
+	WatchSet *set = ((void **)ctx)[0];
+	int *changed = ((void **)ctx)[1];
+	WatchCard *card = &set->cards[changed[task]];
+	card->xml.len = 0;
+	format_card(&card->xml, &card->entry, set->set_name, set->verbose);
+}
+
+// Write the header, every fragment and the footer to a new file that then replaces the output
+int watch_write_xml(WatchSet *set) {
+	char temp[MAX_LINE + 8];
+	snprintf(temp, sizeof(temp), "%s.tmp", set->output);
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) return -1;
+	struct iovec *iov = malloc((set->count + 2) * sizeof(struct iovec));
+	if (!iov) {
+		perror("Cannot allocate XML export");
+		exit(1);
+	}
+	int n = 0;
+	iov[n++] = (struct iovec){ set->header.data, set->header.len };
+	for (uint32_t i = 0; i < set->count; i++) {
+		iov[n++] = (struct iovec){ set->cards[i].xml.data, set->cards[i].xml.len };
+	}
+	iov[n++] = (struct iovec){ XML_FOOTER, strlen(XML_FOOTER) };
+	int result = writev_all(fd, iov, n);
+	free(iov);
+	if (close(fd) != 0) result = -1;
+	if (result == 0) result = rename(temp, set->output);
+	if (result != 0) {
+		int saved = errno;
+		unlink(temp);
+		errno = saved;
+	}
+	return result;
+}
+
+// Bring the set up to date with the input file. Returns the number of cards that changed, or -1
+int watch_update(WatchSet *set) {
+	size_t size;
+	char *data = read_file(set->input, &size);
+	if (!data) return -1;
+
+	// Previous blocks by content, to be claimed by the identical new ones
+	uint32_t slot_count = 64;
+	while (slot_count < set->count * 2) slot_count *= 2;
+	uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+	WatchCard *cards = NULL;
+	uint32_t count = 0, cap = 0;
+	if (!slots) {
+		perror("Cannot allocate watch index");
+		exit(1);
+	}
+	for (uint32_t i = 0; i < set->count; i++) {
+		uint32_t h = set->cards[i].hash;
+		while (slots[h & (slot_count - 1)]) h++;
+		slots[h & (slot_count - 1)] = i + 1;
+	}
+
+	// Cut the new contents into blocks, each starting at an entry's name line
+	for (size_t pos = 0; pos < size;) {
+		size_t len = fgets_len(data + pos, size - pos);
+		if (data[pos] != '\t' && data[pos] != '\n') {
+			if (count) cards[count - 1].len = pos - cards[count - 1].offset;
+			if (count == cap) cards = grow_array(cards, &cap, sizeof(WatchCard), 64);
+			cards[count++] = (WatchCard){ .offset = pos };
+		}
+		pos += len;
+	}
+	if (count) cards[count - 1].len = size - cards[count - 1].offset;
+
+	int *changed = malloc((count + 1) * sizeof(int));
+	Entry *render_list = malloc((count + 1) * sizeof(Entry));
+	if (!changed || !render_list) {
+		perror("Cannot allocate watch update");
+		exit(1);
+	}
+	int changed_count = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		WatchCard *card = &cards[i];
+		card->hash = hash_bytes(data + card->offset, card->len);
+		for (uint32_t h = card->hash;; h++) {
+			uint32_t slot = slots[h & (slot_count - 1)];
+			if (!slot) break;
+			WatchCard *old = &set->cards[slot - 1];
+			if (old->hash != card->hash || old->len != card->len || memcmp(set->data + old->offset, data + card->offset, card->len) != 0) continue;
+			card->entry = old->entry;
+			card->xml = old->xml;
+			old->xml = (StrBuf){ 0 };
+			old->hash = ~old->hash;  // Claimed: an identical block further down needs its own entry
+			break;
+		}
+		if (!card->xml.data) changed[changed_count++] = i;
+	}
+	for (uint32_t i = 0; i < set->count; i++) free(set->cards[i].xml.data);
+	free(slots);
+	free(set->cards);
+	free(set->data);
+	set->cards = cards;
+	set->count = count;
+	set->cap = cap;
+	set->data = data;
+	set->size = size;
+
+	if (set->reparsed + changed_count > 2 * count + 64) {
+		// Replaced entries are garbage in the arena: start it over once they outweigh the live ones
+		reset_set();
+		set->reparsed = 0;
+		for (uint32_t i = 0; i < count; i++) watch_parse(set, &cards[i]);
+	} else {
+		for (int c = 0; c < changed_count; c++) watch_parse(set, &cards[changed[c]]);
+	}
+
+	void *job[] = { set, changed };
+	pool_run(changed_count, watch_format_task, job);
+	int failed = 0;
+	if (set->output && watch_write_xml(set) != 0) {
+		fprintf(stderr, "Cannot write %s: %s\n", set->output, strerror(errno));
+		failed = 1;
+	}
+	if (set->render) {
+		for (int c = 0; c < changed_count; c++) render_list[c] = cards[changed[c]].entry;
+		if (render_entries(render_list, changed_count, 0) != 0) failed = 1;
+		render_cache_save();
+	}
+	free(changed);
+	free(render_list);
+	return failed ? -1 : changed_count;
+}
+
+double elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Convert input to output (if not NULL) and render it if asked, then do
+   it again every time the input is saved, until the process is killed.
+   The directory is watched rather than the file, since many editors save
+   by writing a new file and renaming it over the old one. */
+int watch_osmx(const char *input, const char *output, const char *set_name, const char *longname, const char *release_date, int render, int verbose) {
+	WatchSet set = { input, output, set_name };
+	set.render = render;
+	set.verbose = verbose;
+	format_xml_header(&set.header, set_name, longname, release_date);
+
+	char dir[MAX_LINE];
+	const char *slash = strrchr(input, '/');
+	const char *base = slash ? slash + 1 : input;
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - input) + 1 : 1, slash ? input : ".");
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("Cannot watch input");
+		return 1;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int changed = watch_update(&set);
+	if (changed < 0) fprintf(stderr, "Cannot convert %s\n", input);
+	else printf(" >> Converted %u cards in %.2f ms, watching %s.\n", set.count, elapsed_ms(&start), input);
+	fflush(stdout);
+
+	_Alignas(struct inotify_event) char events[4096];
+	for (;;) {
+		ssize_t n = read(fd, events, sizeof(events));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("Cannot watch input");
+			return 1;
+		}
+		int saved = 0;
+		for (char *p = events; p < events + n;) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			if (event->len && strcmp(event->name, base) == 0) saved = 1;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+		if (!saved) continue;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		changed = watch_update(&set);
+		if (changed < 0) fprintf(stderr, "Cannot convert %s\n", input);
+		else printf(" >> %d of %u cards changed, updated in %.2f ms.\n", changed, set.count, elapsed_ms(&start));
+		fflush(stdout);
+	}
+}
+
 int calculate_cmc(const char *cost, int verbose) {
 	LOGX("Mana cost: %s\n", cost);
 	int cmc = 0;
@@ -549,18 +2511,461 @@ void get_unique_colors(const char *cost, char *colors, int verbose) {
 	LOGX("Unique colors: %s\n", colors);
 }
 
-void render_cards() {
+/* Worker pool shared by the parallel stages. Every job is split into one
+   contiguous range of task indices per worker; a worker that runs out of
+   its own range steals tasks from the others' ranges. The calling thread
+   always takes part as worker 0, so a pool of size 1 runs jobs inline. */
+
+typedef struct {
+	_Alignas(64) atomic_int next;
+	int end;
+} WorkRange;
+
+struct {
+	pthread_t threads[MAX_WORKERS];
+	int size;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned generation;
+	int active;  // Helper threads still working on the current job
+	TaskFn fn;
+	void *ctx;
+	WorkRange ranges[MAX_WORKERS];
+} pool = { .size = 1, .lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+int pool_claim(int worker) {
+	for (int i = 0; i < pool.size; i++) {
+		WorkRange *range = &pool.ranges[(worker + i) % pool.size];
+		if (atomic_load_explicit(&range->next, memory_order_relaxed) >= range->end) continue;
+		int task = atomic_fetch_add(&range->next, 1);
+		if (task < range->end) return task;
+	}
+	return -1;  // Nothing left to steal
+}
+
+void pool_work(int worker) {
+	int task;
+	while ((task = pool_claim(worker)) != -1) {
+		pool.fn(task, worker, pool.ctx);
+	}
+}
+
+void *pool_thread(void *arg) {
+	int worker = (int)(intptr_t)arg;
+	unsigned seen = 0;
+	while (1) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.generation == seen) pthread_cond_wait(&pool.start, &pool.lock);
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_work(worker);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.active == 0) pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	return NULL;
+}
+
+void pool_init(int size) {
+	if (size < 1) size = sysconf(_SC_NPROCESSORS_ONLN);
+	if (size > MAX_WORKERS) size = MAX_WORKERS;
+	while (pool.size < size) {
+		if (pthread_create(&pool.threads[pool.size], NULL, pool_thread, (void *)(intptr_t)pool.size) != 0) break;
+		pool.size++;
+	}
+}
+
+int pool_size() {
+	return pool.size;
+}
+
+// Run fn for every task in [0, tasks) and wait until all of them are done
+void pool_run(int tasks, TaskFn fn, void *ctx) {
+	for (int w = 0; w < pool.size; w++) {
+		atomic_store(&pool.ranges[w].next, (int)((long long)tasks * w / pool.size));
+		pool.ranges[w].end = (int)((long long)tasks * (w + 1) / pool.size);
+	}
+	pool.fn = fn;
+	pool.ctx = ctx;
+
+	if (pool.size > 1) {
+		pthread_mutex_lock(&pool.lock);
+		pool.active = pool.size - 1;
+		pool.generation++;
+		pthread_cond_broadcast(&pool.start);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	pool_work(0);
+	if (pool.size > 1) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.active) pthread_cond_wait(&pool.done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+Image *worker_images[MAX_WORKERS];  // One reusable render target per worker
+atomic_int render_failures;
+
+int render_progress;
+
+/* Render cache: RENDER_CACHE_FILE in the working directory remembers the
+   card_hash() each image file was rendered from, with the file's size and
+   mtime so a file changed behind our back is rendered again. A card whose
+   file still holds its content is not rendered at all. Since the name is
+   both hashed and the file name, a reprint in another set of the same run
+   or of a later one finds the render of the first printing. */
+#define RENDER_CACHE_FILE ".osmx-render-cache"
+
+typedef struct {
+	Str file;
+	uint64_t hash;  // Content the file was rendered from, 0 if unknown
+	int64_t size, mtime;  // mtime in nanoseconds
+	int planned;  // Entry of the current batch that writes this file, -1 if none
+} CacheRecord;
+
+typedef struct {
+	CacheRecord *records;
+	uint32_t count, cap;
+	uint32_t *slots;  // Open addressing by file name, record + 1 or 0 when empty
+	uint32_t slot_count;
+	Arena arena;
+	int loaded, dirty;
+} RenderCache;
+
+RenderCache render_cache;
+int render_cache_flag = 1;  // Cleared by -K: render everything, but still record it
+int render_format = FORMAT_FARBFELD;  // Set by -f
+int atlas_flag = 0;  // Set by -a: render a set into sheets rather than a file per card
+int render_width = WIDTH, render_height = HEIGHT;  // Card size, set by -w and -t
+
+void cache_place(uint32_t record) {
+	Str file = render_cache.records[record].file;
+	uint32_t h = hash_bytes(file, str_len(file));
+	while (render_cache.slots[h & (render_cache.slot_count - 1)]) h++;
+	render_cache.slots[h & (render_cache.slot_count - 1)] = record + 1;
+}
+
+// The record of file, created with an unknown hash if there is none yet
+uint32_t cache_record(const char *file, size_t len) {
+	if (render_cache.slot_count) {
+		for (uint32_t h = hash_bytes(file, len);; h++) {
+			uint32_t slot = render_cache.slots[h & (render_cache.slot_count - 1)];
+			if (!slot) break;
+			Str known = render_cache.records[slot - 1].file;
+			if (str_len(known) == len && memcmp(known, file, len) == 0) return slot - 1;
+		}
+	}
+	if (render_cache.count == render_cache.cap) {
+		render_cache.records = grow_array(render_cache.records, &render_cache.cap, sizeof(CacheRecord), 256);
+	}
+	uint32_t r = render_cache.count++;
+	render_cache.records[r] = (CacheRecord){ arena_str(&render_cache.arena, file, len), 0, 0, 0, -1 };
+	if (render_cache.count * 2 > render_cache.slot_count) {
+		free(render_cache.slots);
+		render_cache.slot_count = render_cache.slot_count ? render_cache.slot_count * 2 : 256;
+		render_cache.slots = calloc(render_cache.slot_count, sizeof(uint32_t));
+		if (!render_cache.slots) {
+			perror("Cannot grow render cache");
+			exit(1);
+		}
+		for (uint32_t i = 0; i < render_cache.count; i++) cache_place(i);
+	} else {
+		cache_place(r);
+	}
+	return r;
+}
+
+int file_state(const char *file, int64_t *size, int64_t *mtime) {
+	struct stat st;
+	if (stat(file, &st) != 0) return -1;
+	*size = st.st_size;
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	return 0;
+}
+
+// Whether the record's file is still exactly what was written for its hash
+int cache_valid(uint32_t record) {
+	CacheRecord *r = &render_cache.records[record];
+	int64_t size, mtime;
+	return r->hash && file_state(r->file, &size, &mtime) == 0 && size == r->size && mtime == r->mtime;
+}
+
+void render_cache_load() {
+	if (render_cache.loaded) return;
+	render_cache.loaded = 1;
+	FILE *file = fopen(RENDER_CACHE_FILE, "r");
+	if (!file) return;
+	char line[MAX_LINE + 64];
+	if (!fgets(line, sizeof(line), file) || strcmp(line, "osmx-render-cache 1\n") != 0) {
+		fclose(file);  // Unknown format: start over, it is rewritten on save
+		return;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		unsigned long long hash;
+		long long size, mtime;
+		int name = 0;
+		size_t len = strcspn(line, "\n");
+		if (sscanf(line, "%llx %lld %lld %n", &hash, &size, &mtime, &name) != 3 || !name || (size_t)name >= len) continue;
+		uint32_t r = cache_record(line + name, len - name);  // May move the records
+		CacheRecord *record = &render_cache.records[r];
+		record->hash = hash;
+		record->size = size;
+		record->mtime = mtime;
+	}
+	fclose(file);
+}
+
+// Write the cache index back if anything changed. Failing to is not fatal: the next run just renders more
+void render_cache_save() {
+	if (!render_cache.dirty) return;
+	FILE *file = fopen(RENDER_CACHE_FILE ".tmp", "w");
+	if (!file) return;
+	fprintf(file, "osmx-render-cache 1\n");
+	for (uint32_t r = 0; r < render_cache.count; r++) {
+		CacheRecord *record = &render_cache.records[r];
+		if (!record->hash) continue;
+		fprintf(file, "%016llx %lld %lld %s\n", (unsigned long long)record->hash, (long long)record->size, (long long)record->mtime, record->file);
+	}
+	if (fclose(file) == 0 && rename(RENDER_CACHE_FILE ".tmp", RENDER_CACHE_FILE) == 0) render_cache.dirty = 0;
+	else unlink(RENDER_CACHE_FILE ".tmp");
+}
+
+size_t card_filename(char *out, size_t size, const Entry *entry) {
+	int len = snprintf(out, size, "%.*s.%s", (int)strcspn(entry->name, "\n"), entry->name, format_extensions[render_format]);
+	return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+typedef struct {
+	Entry *list;
+	int *tasks;  // Entries to render
+	uint8_t *failed;  // Set for every entry that could not be written
+} RenderBatch;
+
+void render_task(int task, int worker, void *ctx) {
+	RenderBatch *batch = ctx;
+	Entry *entry = &batch->list[batch->tasks[task]];
+	Image *img = worker_images[worker];
+	char filename[MAX_LINE];
+	card_filename(filename, sizeof(filename), entry);
+	if (render_progress) printf(" >> Rendering %s...\n", filename);
+	render_card(img, entry);
+	if (save_image(filename, img, render_format) != 0) {
+		fprintf(stderr, " >> Cannot write %s: %s\n", filename, strerror(errno));
+		atomic_fetch_add(&render_failures, 1);
+		batch->failed[batch->tasks[task]] = 1;
+		return;
+	}
+	if (render_progress) printf(" >> %s rendered.\n", filename);
+}
+
+// Render count entries in parallel. Returns the number of cards that could not be written
+int render_entries(Entry *list, int count, int progress) {
+	for (int w = 0; w < pool.size; w++) {
+		if (worker_images[w]) continue;
+		worker_images[w] = new_image(render_width, render_height);
+		if (!worker_images[w]) {
+			perror("Cannot allocate image");
+			exit(1);
+		}
+	}
+	atomic_store(&render_failures, 0);
+	render_progress = progress;
+	render_cache_load();
+
+	uint32_t *records = malloc((count + 1) * sizeof(uint32_t));
+	uint64_t *hashes = malloc((count + 1) * sizeof(uint64_t));
+	int *tasks = malloc((count + 1) * sizeof(int));
+	uint8_t *failed = calloc(count + 1, 1);
+	if (!records || !hashes || !tasks || !failed) {
+		perror("Cannot allocate render plan");
+		exit(1);
+	}
+
+	// Only the last card with a given file name is written, as it always was
+	char filename[MAX_LINE];
+	for (int i = 0; i < count; i++) {
+		size_t len = card_filename(filename, sizeof(filename), &list[i]);
+		records[i] = cache_record(filename, len);
+		hashes[i] = card_hash(&list[i], render_width, render_height);
+		render_cache.records[records[i]].planned = i;
+	}
+	int planned = 0, unchanged = 0;
+	for (int i = 0; i < count; i++) {
+		CacheRecord *record = &render_cache.records[records[i]];
+		if (record->planned != i) continue;
+		record->planned = -1;
+		if (render_cache_flag && record->hash == hashes[i] && cache_valid(records[i])) {
+			unchanged++;
+			if (progress) printf(" >> %s unchanged.\n", record->file);
+			continue;
+		}
+		tasks[planned++] = i;
+	}
+
+	RenderBatch batch = { list, tasks, failed };
+	pool_run(planned, render_task, &batch);
+	for (int t = 0; t < planned; t++) {
+		CacheRecord *record = &render_cache.records[records[tasks[t]]];
+		record->hash = hashes[tasks[t]];
+		if (failed[tasks[t]] || file_state(record->file, &record->size, &record->mtime) != 0) record->hash = 0;
+		render_cache.dirty = 1;
+	}
+	if (progress && unchanged) printf("%d cards unchanged since they were last rendered.\n", unchanged);
+
+	free(records);
+	free(hashes);
+	free(tasks);
+	free(failed);
+	return atomic_load(&render_failures);
+}
+
+int render_cards(const char *set_name) {
 	printf("Rendering cards...\n");
-	Image img;
-	for(int i = 0; i < entry_count; ++i) {
-		char filename[MAX_LINE];
-		strcpy(filename, entries[i].name);
-		filename[strcspn(filename, "\n")] = '\0';
-		strcat(filename, ".ff");
-		printf(" >> Rendering %s...\n", filename);
-		render_card(&img, entries[i]);
-		save_farbfeld(filename, &img);
-		printf(" >> %s rendered.\n", filename);
+	int failures;
+	if (atlas_flag) {
+		Atlas *atlas = atlas_open(set_name);
+		atlas_add(atlas, entries, entry_count);
+		failures = atlas_close(atlas);
+	} else {
+		failures = render_entries(entries, entry_count, 1);
+		render_cache_save();
 	}
 	printf("Cards rendered.\n");
+	return failures;
+}
+
+/* Atlas mode (-a) packs the cards of a set into sheets of ATLAS_COLUMNS by
+   ATLAS_ROWS cards instead of writing a file per card: <set>-1.ff,
+   <set>-2.ff and so on, in the -f format. <set>.atlas indexes them with a
+   line per card: name, sheet, x, y, width and height separated by tabs.
+   A row of cards is rendered in parallel and written out as soon as it is
+   complete, so only one row of card images is ever held. Sheets are always
+   rendered in full, the render cache only knows single cards. */
+#define ATLAS_COLUMNS 10
+#define ATLAS_ROWS 10
+
+struct Atlas {
+	char set_name[MAX_LINE];
+	FILE *index;
+	ImageWriter sheet;
+	char sheet_name[MAX_LINE + 32];
+	int sheet_count, sheet_open;  // Sheets started, and whether the last one is still being written
+	int row_count, column_count;  // Rows finished in the open sheet, cards placed in the next row
+	Image *row[ATLAS_COLUMNS];
+	uint8_t *scanline;  // One pixel row across the whole sheet
+	int failures;
+};
+
+Atlas *atlas_open(const char *set_name) {
+	Atlas *atlas = calloc(1, sizeof(Atlas));
+	if (!atlas || !(atlas->scanline = malloc((size_t)ATLAS_COLUMNS * render_width * 3))) {
+		perror("Cannot allocate atlas");
+		exit(1);
+	}
+	for (int c = 0; c < ATLAS_COLUMNS; c++) {
+		if (!(atlas->row[c] = new_image(render_width, render_height))) {
+			perror("Cannot allocate atlas");
+			exit(1);
+		}
+	}
+	snprintf(atlas->set_name, sizeof(atlas->set_name), "%s", set_name);
+	char filename[MAX_LINE + 8];
+	snprintf(filename, sizeof(filename), "%s.atlas", set_name);
+	if (!(atlas->index = fopen(filename, "w"))) {
+		fprintf(stderr, " >> Cannot write %s: %s\n", filename, strerror(errno));
+		atlas->failures++;
+	}
+	return atlas;
+}
+
+// Write the finished row of cards to the open sheet, starting one first if needed
+void atlas_write_row(Atlas *atlas) {
+	STAT_START(start);
+	uint64_t written = stat_write_ns;
+	int cards = atlas->column_count;
+	if (!atlas->sheet_open) {
+		atlas->sheet_open = 1;
+		atlas->row_count = 0;
+		snprintf(atlas->sheet_name, sizeof(atlas->sheet_name), "%s-%d.%s", atlas->set_name, ++atlas->sheet_count, format_extensions[render_format]);
+		if (writer_open(&atlas->sheet, atlas->sheet_name, render_format, ATLAS_COLUMNS * render_width, ATLAS_ROWS * render_height) != 0) {
+			fprintf(stderr, " >> Cannot write %s: %s\n", atlas->sheet_name, strerror(errno));
+			atlas->failures++;
+			atlas->sheet.out = NULL;
+		}
+	}
+	// Columns past the last card of the set stay black
+	for (int c = atlas->column_count; c < ATLAS_COLUMNS; c++) init_image(atlas->row[c], 0, 0, 0);
+	if (atlas->sheet.out) {
+		size_t width = (size_t)render_width * 3;
+		for (int y = 0; y < render_height; y++) {
+			for (int c = 0; c < ATLAS_COLUMNS; c++) memcpy(atlas->scanline + c * width, PIXEL(atlas->row[c], 0, y), width);
+			writer_row(&atlas->sheet, atlas->scanline);
+		}
+	}
+	atlas->column_count = 0;
+	if (++atlas->row_count == ATLAS_ROWS) {
+		atlas->sheet_open = 0;
+		if (atlas->sheet.out && writer_close(&atlas->sheet) != 0) {
+			fprintf(stderr, " >> Cannot write %s: %s\n", atlas->sheet_name, strerror(errno));
+			atlas->failures++;
+		}
+	}
+	stats_record_save(start, written, cards);
+}
+
+typedef struct {
+	Atlas *atlas;
+	Entry *list;  // The cards of the row being rendered, from its first empty column on
+	int column;
+} AtlasRow;
+
+void atlas_task(int task, int worker, void *ctx) {
+	AtlasRow *row = ctx;
+	render_card(row->atlas->row[row->column + task], &row->list[task]);
+}
+
+// Render count more cards into the atlas
+void atlas_add(Atlas *atlas, Entry *list, int count) {
+	while (count > 0) {
+		int n = ATLAS_COLUMNS - atlas->column_count;
+		if (n > count) n = count;
+		AtlasRow row = { atlas, list, atlas->column_count };
+		pool_run(n, atlas_task, &row);
+		for (int i = 0; i < n && atlas->index; i++) {
+			int row_in_sheet = atlas->sheet_open ? atlas->row_count : 0;
+			fprintf(atlas->index, "%.*s\t%s-%d.%s\t%d\t%d\t%d\t%d\n", (int)strcspn(list[i].name, "\n"), list[i].name,
+				atlas->set_name, atlas->sheet_count + !atlas->sheet_open, format_extensions[render_format],
+				(atlas->column_count + i) * render_width, row_in_sheet * render_height, render_width, render_height);
+		}
+		atlas->column_count += n;
+		if (atlas->column_count == ATLAS_COLUMNS) atlas_write_row(atlas);
+		list += n;
+		count -= n;
+	}
+}
+
+// Write out what is left and free the atlas. Returns the number of files that could not be written
+int atlas_close(Atlas *atlas) {
+	if (atlas->column_count) atlas_write_row(atlas);
+	// A short last sheet ends after its last row of cards
+	STAT_START(start);
+	uint64_t written = stat_write_ns;
+	if (atlas->sheet_open && atlas->sheet.out) {
+		if (writer_close(&atlas->sheet) != 0) {
+			fprintf(stderr, " >> Cannot write %s: %s\n", atlas->sheet_name, strerror(errno));
+			atlas->failures++;
+		}
+		stats_record_save(start, written, 1);
+	}
+	if (atlas->index && fclose(atlas->index) != 0) {
+		fprintf(stderr, " >> Cannot write %s.atlas: %s\n", atlas->set_name, strerror(errno));
+		atlas->failures++;
+	}
+	int failures = atlas->failures;
+	for (int c = 0; c < ATLAS_COLUMNS; c++) free_image(atlas->row[c]);
+	free(atlas->scanline);
+	free(atlas);
+	return failures;
 }
@@ -4,69 +4,757 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
-#define WIDTH 375
+#define WIDTH 375  // Default card size, which the layout of render_card() was designed at
 #define HEIGHT 523
+#define THUMBNAIL_WIDTH 125  // Card width of -t, a third of the default
 #define HEADER_SIZE 16  // Farbfeld header size
+#define RENDERER_VERSION 4  // Bump whenever render_card() output changes, so cached renders are redone
+
+/* Pipeline statistics, recorded while stats_enabled is set (--stats):
+   counters, and latency histograms in powers of two of nanoseconds. Both
+   are relaxed atomics, so any thread can record; switched off, a hook is
+   one predictable branch. */
+enum {
+	STAT_PARSE_BYTES, STAT_PARSE_LINES, STAT_ENTRIES, STAT_METADATA, STAT_SEARCHES,
+	STAT_REPLACEMENTS, STAT_XML_BYTES, STAT_IMAGE_BYTES, STAT_COUNTERS
+};
+enum { TIMER_PARSE, TIMER_XML, TIMER_RENDER, TIMER_ENCODE, TIMER_WRITE, STAT_TIMERS };
+#define STAT_BUCKETS 40  // Bucket b counts latencies below 2^b ns, the last one everything longer
 
-// Simple structure for an image buffer
 typedef struct {
-    uint8_t pixels[HEIGHT][WIDTH][3];  // RGB only
+	atomic_ullong count, total_ns, max_ns;
+	atomic_ullong buckets[STAT_BUCKETS];
+} StatTimer;
+
+const char *stat_counter_names[STAT_COUNTERS] = { "parse_bytes", "parse_lines", "entries", "metadata_pairs", "searches", "replacements", "xml_bytes", "image_bytes" };
+const char *stat_timer_names[STAT_TIMERS] = { "parse", "xml", "render", "encode", "write" };
+int stats_enabled;
+atomic_ullong stat_counters[STAT_COUNTERS];
+StatTimer stat_timers[STAT_TIMERS];
+_Thread_local uint64_t stat_write_ns;  // Time this thread spent in write_all(), so saving can be split into encoding and writing
+
+static inline uint64_t stats_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+void stats_record(int timer, uint64_t ns) {
+	StatTimer *t = &stat_timers[timer];
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= STAT_BUCKETS) bucket = STAT_BUCKETS - 1;
+	atomic_fetch_add_explicit(&t->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&t->total_ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&t->buckets[bucket], 1, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&t->max_ns, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&t->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+#define STAT_ADD(counter, n) do { if (stats_enabled) atomic_fetch_add_explicit(&stat_counters[counter], (n), memory_order_relaxed); } while (0)
+#define STAT_START(start) uint64_t start = stats_enabled ? stats_now() : 0
+#define STAT_STOP(timer, start) do { if (stats_enabled) stats_record(timer, stats_now() - (start)); } while (0)
+
+// An RGB image of any size. Rows are stride bytes apart, so an image can be a window into a bigger one
+typedef struct {
+	int width, height;
+	size_t stride;
+	uint8_t *pixels;
 } Image;
 
+#define PIXEL(img, x, y) ((img)->pixels + (size_t)(y) * (img)->stride + 3 * (size_t)(x))
+
+// A black image of the given size, NULL with errno set if it cannot be allocated
+Image *new_image(int width, int height) {
+	Image *img = malloc(sizeof(Image));
+	if (!img) return NULL;
+	*img = (Image){ width, height, (size_t)width * 3, calloc((size_t)width * height, 3) };
+	if (!img->pixels) {
+		free(img);
+		return NULL;
+	}
+	return img;
+}
+
+void free_image(Image *img) {
+	if (!img) return;
+	free(img->pixels);
+	free(img);
+}
+
+// Card height for a card width, in the proportions of WIDTH by HEIGHT
+int card_height(int width) {
+	return (int)(((long)width * HEIGHT + WIDTH / 2) / WIDTH);
+}
+
+/* Span primitives: everything is drawn as runs of pixels of one colour,
+   confined to a clip rectangle. Runs are clipped once, so the inner loops
+   have no bounds checks. */
+typedef struct {
+	int x0, y0, x1, y1;  // Inclusive
+} Clip;
+
+static inline Clip image_clip(const Image *img) {
+	return (Clip){ 0, 0, img->width - 1, img->height - 1 };
+}
+
+// Set count pixels starting at p to one colour
+void fill_span(uint8_t *p, int count, uint8_t r, uint8_t g, uint8_t b) {
+	int i = 0;
+#ifdef __SSE2__
+	if (count >= 16) {
+		// 16 pixels are 48 bytes, three registers holding the colour pattern at each phase
+		uint8_t pattern[48];
+		for (int k = 0; k < 48; k += 3) {
+			pattern[k] = r;
+			pattern[k+1] = g;
+			pattern[k+2] = b;
+		}
+		__m128i v0 = _mm_loadu_si128((const __m128i *)pattern);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+		for (; i + 16 <= count; i += 16) {
+			_mm_storeu_si128((__m128i *)(p + 3 * i), v0);
+			_mm_storeu_si128((__m128i *)(p + 3 * i + 16), v1);
+			_mm_storeu_si128((__m128i *)(p + 3 * i + 32), v2);
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		p[3 * i] = r;
+		p[3 * i + 1] = g;
+		p[3 * i + 2] = b;
+	}
+}
+
+// Fill the pixels from x1 to x2 of row y, both included and in either order
+void span_hline(Image *img, Clip clip, int y, int x1, int x2, uint8_t r, uint8_t g, uint8_t b) {
+	if (x1 > x2) { int t = x1; x1 = x2; x2 = t; }
+	if (y < clip.y0 || y > clip.y1) return;
+	if (x1 < clip.x0) x1 = clip.x0;
+	if (x2 > clip.x1) x2 = clip.x1;
+	if (x1 <= x2) fill_span(PIXEL(img, x1, y), x2 - x1 + 1, r, g, b);
+}
+
+// Fill the pixels from y1 to y2 of column x, both included and in either order
+void span_vline(Image *img, Clip clip, int x, int y1, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	if (y1 > y2) { int t = y1; y1 = y2; y2 = t; }
+	if (x < clip.x0 || x > clip.x1) return;
+	if (y1 < clip.y0) y1 = clip.y0;
+	if (y2 > clip.y1) y2 = clip.y1;
+	for (int y = y1; y <= y2; y++) {
+		uint8_t *p = PIXEL(img, x, y);
+		p[0] = r;
+		p[1] = g;
+		p[2] = b;
+	}
+}
+
+// Fill a rectangle, corners included
+void span_rect(Image *img, Clip clip, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	if (x1 < clip.x0) x1 = clip.x0;
+	if (y1 < clip.y0) y1 = clip.y0;
+	if (x2 > clip.x1) x2 = clip.x1;
+	if (y2 > clip.y1) y2 = clip.y1;
+	if (x1 > x2 || y1 > y2) return;
+	// Fill the first row, then copy it down
+	size_t row = (size_t)(x2 - x1 + 1) * 3;
+	fill_span(PIXEL(img, x1, y1), x2 - x1 + 1, r, g, b);
+	for (int y = y1 + 1; y <= y2; y++) memcpy(PIXEL(img, x1, y), PIXEL(img, x1, y1), row);
+}
+
+/* Display list: while display_list is set, the draw_ functions record what
+   they would draw instead, and rasterize() draws the whole list later, one
+   tile at a time. render_card() works this way. */
+typedef struct {
+	int16_t y, x0, x1;  // Pixels x0 to x1 of row y
+} GlyphRun;
+
+enum { PRIM_RECT, PRIM_LINE, PRIM_CIRCLE, PRIM_DISC, PRIM_RUNS, PRIM_SPRITE };
+
+typedef struct {
+	uint8_t kind, r, g, b;
+	int x1, y1, x2, y2;  // Corners, end points, centre and radius, or the origin of the runs
+	Clip box;  // Every pixel the primitive can touch
+	const GlyphRun *runs;
+	int run_count;
+	Clip clip;  // display_clip when it was recorded
+	const struct Sprite *sprite;
+} Primitive;
+
+typedef struct {
+	Primitive *items;
+	int count, cap;
+} DisplayList;
+
+_Thread_local DisplayList *display_list;
+_Thread_local Clip display_clip = { 0, 0, INT_MAX, INT_MAX };  // What recorded primitives may draw on
+
+Clip intersect_clip(Clip a, Clip b) {
+	return (Clip){ a.x0 > b.x0 ? a.x0 : b.x0, a.y0 > b.y0 ? a.y0 : b.y0, a.x1 < b.x1 ? a.x1 : b.x1, a.y1 < b.y1 ? a.y1 : b.y1 };
+}
+
+void record_primitive(Primitive p) {
+	DisplayList *list = display_list;
+	// Whatever lies entirely outside the clip is dropped right away
+	p.clip = display_clip;
+	p.box = intersect_clip(p.box, display_clip);
+	if (p.box.x0 > p.box.x1 || p.box.y0 > p.box.y1) return;
+	if (list->count == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 256;
+		list->items = realloc(list->items, list->cap * sizeof(Primitive));
+		if (!list->items) {
+			perror("Cannot grow display list");
+			exit(1);
+		}
+	}
+	list->items[list->count++] = p;
+}
+
+void record_rect(int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	record_primitive((Primitive){ .kind = PRIM_RECT, .r = r, .g = g, .b = b, .x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2, .box = { x1, y1, x2, y2 } });
+}
+
+// Fill the pixels from x1 to x2 of row y, both included and in either order
+void draw_hline(Image *img, int y, int x1, int x2, uint8_t r, uint8_t g, uint8_t b) {
+	if (display_list) record_rect(x1 < x2 ? x1 : x2, y, x1 < x2 ? x2 : x1, y, r, g, b);
+	else span_hline(img, image_clip(img), y, x1, x2, r, g, b);
+}
+
+// Fill the pixels from y1 to y2 of column x, both included and in either order
+void draw_vline(Image *img, int x, int y1, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	if (display_list) record_rect(x, y1 < y2 ? y1 : y2, x, y1 < y2 ? y2 : y1, r, g, b);
+	else span_vline(img, image_clip(img), x, y1, y2, r, g, b);
+}
+
+// Draw a simple rectangle (border, text box, etc.), corners included
+void draw_rect(Image *img, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	if (display_list) record_rect(x1, y1, x2, y2, r, g, b);
+	else span_rect(img, image_clip(img), x1, y1, x2, y2, r, g, b);
+}
+
 // Initialize the image with a background color
 void init_image(Image *img, uint8_t r, uint8_t g, uint8_t b) {
-	for (int y = 0; y < HEIGHT; y++) {
-		for (int x = 0; x < WIDTH; x++) {
-			img->pixels[y][x][0] = r;
-			img->pixels[y][x][1] = g;
-			img->pixels[y][x][2] = b;
+	draw_rect(img, 0, 0, img->width - 1, img->height - 1, r, g, b);
+}
+
+// Expand packed RGB8 pixels to farbfeld's RGBA16BE: every channel byte is doubled and alpha is opaque
+void expand_rgba16(uint8_t *dst, const uint8_t *src, size_t count) {
+	size_t i = 0;
+#ifdef __SSSE3__
+	const __m128i lo = _mm_setr_epi8(0, 0, 1, 1, 2, 2, -1, -1, 3, 3, 4, 4, 5, 5, -1, -1);
+	const __m128i hi = _mm_setr_epi8(6, 6, 7, 7, 8, 8, -1, -1, 9, 9, 10, 10, 11, 11, -1, -1);
+	const __m128i alpha = _mm_setr_epi8(0, 0, 0, 0, 0, 0, -1, -1, 0, 0, 0, 0, 0, 0, -1, -1);
+	for (; i + 6 <= count; i += 4) {  // 4 pixels per step, the 16 byte load must stay inside src
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+		_mm_storeu_si128((__m128i *)(dst + 8 * i), _mm_or_si128(_mm_shuffle_epi8(v, lo), alpha));
+		_mm_storeu_si128((__m128i *)(dst + 8 * i + 16), _mm_or_si128(_mm_shuffle_epi8(v, hi), alpha));
+	}
+#endif
+	for (; i < count; i++) {
+		const uint8_t *p = src + 3 * i;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		uint64_t v = ((uint64_t)p[0] | (uint64_t)p[1] << 16 | (uint64_t)p[2] << 32) * 0x0101 | 0xFFFF000000000000ull;
+		memcpy(dst + 8 * i, &v, 8);
+#else
+		uint8_t *q = dst + 8 * i;
+		q[0] = q[1] = p[0];
+		q[2] = q[3] = p[1];
+		q[4] = q[5] = p[2];
+		q[6] = q[7] = 255;
+#endif
+	}
+}
+
+void put_be32(uint8_t *dst, uint32_t v) {
+	dst[0] = v >> 24; dst[1] = v >> 16; dst[2] = v >> 8; dst[3] = v;
+}
+
+// Write the whole buffer, retrying short writes. Returns 0 on success, -1 with errno set on failure
+int write_all(int fd, const uint8_t *data, size_t size) {
+	STAT_START(start);
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
 		}
+		data += n;
+		size -= n;
 	}
+	if (stats_enabled) stat_write_ns += stats_now() - start;
+	return 0;
 }
 
-// Draw a simple rectangle (border, text box, etc.)
-void draw_rect(Image *img, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
-	for (int y = y1; y <= y2; y++) {
-		for (int x = x1; x <= x2; x++) {
-			if (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT) {
-				img->pixels[y][x][0] = r;
-				img->pixels[y][x][1] = g;
-				img->pixels[y][x][2] = b;
+// Write the image in Farbfeld format. Returns 0 on success, -1 with errno set on failure
+int save_farbfeld(const char *filename, Image *img) {
+	static _Thread_local uint8_t *buffer;  // Reused for every image this thread saves
+	static _Thread_local size_t buffer_size;
+	size_t size = HEADER_SIZE + (size_t)img->width * img->height * 8;
+	if (size > buffer_size) {
+		free(buffer);
+		buffer_size = 0;
+		if (!(buffer = malloc(size))) return -1;
+		buffer_size = size;
+	}
+
+	memcpy(buffer, "farbfeld", 8);
+	put_be32(buffer + 8, img->width);
+	put_be32(buffer + 12, img->height);
+	for (int y = 0; y < img->height; y++) expand_rgba16(buffer + HEADER_SIZE + (size_t)y * img->width * 8, PIXEL(img, 0, y), img->width);
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) return -1;
+	STAT_ADD(STAT_IMAGE_BYTES, size);
+	if (write_all(fd, buffer, size) != 0) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	return close(fd);
+}
+
+/* Buffered output for the streaming encoders: bytes are collected and
+   written out OUT_BUFFER bytes at a time, and the first write error is
+   kept until the end. */
+#define OUT_BUFFER 65536
+
+typedef struct {
+	int fd, error;  // errno of the first failed write, 0 if none
+	size_t len;
+	uint8_t data[OUT_BUFFER];
+} OutBuffer;
+
+void out_flush(OutBuffer *out) {
+	STAT_ADD(STAT_IMAGE_BYTES, out->len);
+	if (!out->error && out->len && write_all(out->fd, out->data, out->len) != 0) out->error = errno;
+	out->len = 0;
+}
+
+void out_bytes(OutBuffer *out, const void *data, size_t len) {
+	const uint8_t *bytes = data;
+	while (len > 0) {
+		if (out->len == OUT_BUFFER) out_flush(out);
+		size_t n = OUT_BUFFER - out->len < len ? OUT_BUFFER - out->len : len;
+		memcpy(out->data + out->len, bytes, n);
+		out->len += n;
+		bytes += n;
+		len -= n;
+	}
+}
+
+static inline void out_byte(OutBuffer *out, uint8_t byte) {
+	if (out->len == OUT_BUFFER) out_flush(out);
+	out->data[out->len++] = byte;
+}
+
+// A thread's output buffer, opened on a new file. NULL with errno set on failure. A thread writes one file at a time
+OutBuffer *out_open(const char *filename) {
+	static _Thread_local OutBuffer *out;
+	if (!out && !(out = malloc(sizeof(OutBuffer)))) return NULL;
+	out->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out->fd < 0) return NULL;
+	out->error = 0;
+	out->len = 0;
+	return out;
+}
+
+// Flush and close. Returns 0 on success, -1 with errno set on failure
+int out_close(OutBuffer *out) {
+	out_flush(out);
+	if (close(out->fd) != 0 && !out->error) out->error = errno;
+	errno = out->error;
+	return out->error ? -1 : 0;
+}
+
+/* PNG: the rows are compressed one at a time as they are written, with a
+   small deflate of fixed Huffman codes and greedy LZ77 over a 32 KB window.
+   Flat colour, most of a card, turns into long matches at a distance of
+   one pixel or one row. */
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH 32768
+#define DEFLATE_CHAIN 32  // Match candidates tried per position
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define PNG_CHUNK 65536  // IDAT data per chunk
+
+uint32_t crc_table[256];
+uint16_t fixed_codes[288];  // Literal/length codes, bit reversed for the LSB first bit stream
+uint8_t fixed_lengths[288];
+pthread_once_t png_tables = PTHREAD_ONCE_INIT;
+
+const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+uint32_t reverse_bits(uint32_t code, int length) {
+	uint32_t reversed = 0;
+	for (int i = 0; i < length; i++) reversed |= ((code >> i) & 1) << (length - 1 - i);
+	return reversed;
+}
+
+void build_png_tables() {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+	for (int sym = 0; sym < 288; sym++) {
+		int length = sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+		int code = sym < 144 ? 0x30 + sym : sym < 256 ? 0x190 + sym - 144 : sym < 280 ? sym - 256 : 0xc0 + sym - 280;
+		fixed_codes[sym] = reverse_bits(code, length);
+		fixed_lengths[sym] = length;
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+	for (size_t i = 0; i < len; i++) crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+typedef struct {
+	OutBuffer *out;
+	uint8_t chunk[PNG_CHUNK];  // IDAT data not written yet
+	size_t chunk_len;
+	uint64_t bits;
+	int bit_count;
+	uint8_t window[2 * DEFLATE_WINDOW + MAX_MATCH];
+	int window_len, pos;  // Bytes in the window, and the first one not compressed yet
+	long base;  // Stream position of window[0]
+	int32_t head[DEFLATE_HASH];  // Last stream position of every hash, -1 if none
+	int32_t prev[DEFLATE_WINDOW];  // Previous stream position with the same hash
+	uint32_t adler_a, adler_b;
+} Deflate;
+
+void png_chunk(OutBuffer *out, const char *type, const uint8_t *data, size_t len) {
+	uint8_t header[8];
+	put_be32(header, len);
+	memcpy(header + 4, type, 4);
+	out_bytes(out, header, 8);
+	out_bytes(out, data, len);
+	uint8_t crc[4];
+	put_be32(crc, ~crc32_update(crc32_update(~0u, (const uint8_t *)type, 4), data, len));
+	out_bytes(out, crc, 4);
+}
+
+static inline void idat_byte(Deflate *d, uint8_t byte) {
+	if (d->chunk_len == PNG_CHUNK) {
+		png_chunk(d->out, "IDAT", d->chunk, d->chunk_len);
+		d->chunk_len = 0;
+	}
+	d->chunk[d->chunk_len++] = byte;
+}
+
+static inline void put_bits(Deflate *d, uint32_t value, int count) {
+	d->bits |= (uint64_t)value << d->bit_count;
+	d->bit_count += count;
+	while (d->bit_count >= 8) {
+		idat_byte(d, d->bits);
+		d->bits >>= 8;
+		d->bit_count -= 8;
+	}
+}
+
+static inline void put_symbol(Deflate *d, int sym) {
+	put_bits(d, fixed_codes[sym], fixed_lengths[sym]);
+}
+
+void put_match(Deflate *d, int length, int distance) {
+	int l = 0, c = 0;
+	while (l < 28 && length_base[l + 1] <= length) l++;
+	put_symbol(d, 257 + l);
+	put_bits(d, length - length_base[l], length_extra[l]);
+	while (c < 29 && distance_base[c + 1] <= distance) c++;
+	put_bits(d, reverse_bits(c, 5), 5);
+	put_bits(d, distance - distance_base[c], distance_extra[c]);
+}
+
+static inline uint32_t deflate_hash(const uint8_t *p) {
+	return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 17;
+}
+
+// Compress the window up to limit, which must leave MAX_MATCH bytes of lookahead unless the stream ends there
+void deflate_compress(Deflate *d, int limit) {
+	while (d->pos < limit) {
+		int best = 0, best_distance = 0;
+		int available = d->window_len - d->pos < MAX_MATCH ? d->window_len - d->pos : MAX_MATCH;
+		const uint8_t *here = d->window + d->pos;
+		long stream_pos = d->base + d->pos;
+		uint32_t h = 0;
+		if (available >= MIN_MATCH) {
+			h = deflate_hash(here);
+			int32_t candidate = d->head[h];
+			for (int tries = 0; candidate >= 0 && tries < DEFLATE_CHAIN; tries++) {
+				long distance = stream_pos - candidate;
+				if (distance <= 0 || distance > DEFLATE_WINDOW || candidate < d->base) break;
+				const uint8_t *there = d->window + (candidate - d->base);
+				if (there[best] == here[best]) {
+					int length = 0;
+					while (length < available && there[length] == here[length]) length++;
+					if (length > best) {
+						best = length;
+						best_distance = distance;
+						if (length == available) break;
+					}
+				}
+				candidate = d->prev[candidate & (DEFLATE_WINDOW - 1)];
 			}
 		}
+		int advance = 1;
+		if (best >= MIN_MATCH) {
+			put_match(d, best, best_distance);
+			advance = best;
+		} else {
+			put_symbol(d, here[0]);
+		}
+		// Remember every position passed over, so later data can match it
+		for (int i = 0; i < advance; i++) {
+			if (d->window_len - (d->pos + i) >= MIN_MATCH) {
+				long p = d->base + d->pos + i;
+				uint32_t hp = i == 0 && available >= MIN_MATCH ? h : deflate_hash(d->window + d->pos + i);
+				d->prev[p & (DEFLATE_WINDOW - 1)] = d->head[hp];
+				d->head[hp] = p;
+			}
+		}
+		d->pos += advance;
 	}
 }
 
-// Write the image in Farbfeld format
-void save_farbfeld(const char *filename, Image *img) {
-	FILE *f = fopen(filename, "wb");
-	if (!f) return;
-	
-	// Write header
-	fputs("farbfeld", f);
-	fputc(WIDTH / 16777216, f); fputc((WIDTH / 65536) % 256, f);
-	fputc((WIDTH / 256) % 256, f); fputc(WIDTH % 256, f);
+void deflate_write(Deflate *d, const uint8_t *data, size_t len) {
+	// Adler-32 of the uncompressed data, reduced often enough not to overflow
+	for (size_t i = 0; i < len;) {
+		size_t n = len - i < 5552 ? len - i : 5552;
+		for (size_t k = 0; k < n; k++) {
+			d->adler_a += data[i + k];
+			d->adler_b += d->adler_a;
+		}
+		d->adler_a %= 65521;
+		d->adler_b %= 65521;
+		i += n;
+	}
+	while (len > 0) {
+		if (d->window_len == (int)sizeof(d->window)) {
+			// Slide: the older half of the window can no longer be matched
+			deflate_compress(d, d->window_len - MAX_MATCH);
+			memmove(d->window, d->window + DEFLATE_WINDOW, d->window_len - DEFLATE_WINDOW);
+			d->window_len -= DEFLATE_WINDOW;
+			d->pos -= DEFLATE_WINDOW;
+			d->base += DEFLATE_WINDOW;
+		}
+		size_t n = sizeof(d->window) - d->window_len < len ? sizeof(d->window) - d->window_len : len;
+		memcpy(d->window + d->window_len, data, n);
+		d->window_len += n;
+		data += n;
+		len -= n;
+		if (d->window_len - MAX_MATCH > d->pos) deflate_compress(d, d->window_len - MAX_MATCH);
+	}
+}
 
-	fputc(HEIGHT / 16777216, f); fputc((HEIGHT / 65536) % 256, f);
-	fputc((HEIGHT / 256) % 256, f); fputc(HEIGHT % 256, f);
-	
-	// Write pixel data (Farbfeld requires 16-bit per channel, so we duplicate bytes)
-	for (int y = 0; y < HEIGHT; y++) {
-		for (int x = 0; x < WIDTH; x++) {
-			uint8_t r = img->pixels[y][x][0];
-			uint8_t g = img->pixels[y][x][1];
-			uint8_t b = img->pixels[y][x][2];
-			
-			fputc(r, f); fputc(r, f);
-			fputc(g, f); fputc(g, f);
-			fputc(b, f); fputc(b, f);
-			fputc(255, f); fputc(255, f);  // Full alpha
+enum { FORMAT_FARBFELD, FORMAT_QOI, FORMAT_PNG };
+const char *format_extensions[] = { "ff", "qoi", "png" };
+
+/* An image written a row at a time, in any format, for images too big to
+   hold: an atlas sheet is encoded as its rows of cards are rendered. If
+   fewer rows than announced are written, the height in the header is
+   corrected when the writer is closed. */
+typedef struct {
+	OutBuffer *out;
+	int format, width, height, rows;
+	uint8_t *expanded;  // Farbfeld: one row of 16 bit RGBA
+	uint8_t seen[64][3], prev[3];  // QOI: index and previous pixel, alpha is always 255
+	int run, seen_black;
+	Deflate *deflate;  // PNG
+	uint8_t ihdr[13];
+} ImageWriter;
+
+// Returns 0 on success, -1 with errno set on failure
+int writer_open(ImageWriter *w, const char *filename, int format, int width, int height) {
+	static _Thread_local Deflate *deflate;
+	*w = (ImageWriter){ .format = format, .width = width, .height = height };
+	if (format == FORMAT_FARBFELD && !(w->expanded = malloc((size_t)width * 8))) return -1;
+	if (format == FORMAT_PNG) {
+		pthread_once(&png_tables, build_png_tables);
+		if (!deflate && !(deflate = malloc(sizeof(Deflate)))) return -1;
+		w->deflate = deflate;
+	}
+	if (!(w->out = out_open(filename))) {
+		free(w->expanded);
+		return -1;
+	}
+
+	if (format == FORMAT_FARBFELD) {
+		uint8_t header[HEADER_SIZE] = { 'f', 'a', 'r', 'b', 'f', 'e', 'l', 'd' };
+		put_be32(header + 8, width);
+		put_be32(header + 12, height);
+		out_bytes(w->out, header, sizeof(header));
+	} else if (format == FORMAT_QOI) {
+		uint8_t header[14] = { 'q', 'o', 'i', 'f' };
+		put_be32(header + 4, width);
+		put_be32(header + 8, height);
+		header[12] = 3;  // RGB
+		header[13] = 0;  // sRGB
+		out_bytes(w->out, header, sizeof(header));
+	} else {
+		out_bytes(w->out, "\x89PNG\r\n\x1a\n", 8);
+		put_be32(w->ihdr, width);
+		put_be32(w->ihdr + 4, height);
+		w->ihdr[8] = 8;  // Bits per channel
+		w->ihdr[9] = 2;  // RGB
+		w->ihdr[10] = w->ihdr[11] = w->ihdr[12] = 0;  // Deflate, no filters but None, not interlaced
+		png_chunk(w->out, "IHDR", w->ihdr, sizeof(w->ihdr));
+
+		Deflate *d = w->deflate;
+		d->out = w->out;
+		d->chunk_len = 0;
+		d->bits = 0;
+		d->bit_count = 0;
+		d->window_len = d->pos = 0;
+		d->base = 0;
+		d->adler_a = 1;
+		d->adler_b = 0;
+		memset(d->head, 0xff, sizeof(d->head));
+		idat_byte(d, 0x78);  // zlib header: deflate with a 32 KB window
+		idat_byte(d, 0x01);
+		put_bits(d, 1, 1);  // Final block
+		put_bits(d, 1, 2);  // Fixed Huffman codes
+	}
+	return 0;
+}
+
+void qoi_run(ImageWriter *w) {
+	if (w->run) out_byte(w->out, 0xc0 | (w->run - 1));
+	w->run = 0;
+}
+
+void qoi_row(ImageWriter *w, const uint8_t *rgb) {
+	OutBuffer *out = w->out;
+	for (int x = 0; x < w->width; x++) {
+		const uint8_t *p = rgb + 3 * x;
+		if (memcmp(p, w->prev, 3) == 0) {
+			if (++w->run == 62) qoi_run(w);
+			continue;
+		}
+		qoi_run(w);
+		// Pixel 0,0,0,255 hashes to slot 53 of the index, which has to be known to match it
+		int slot = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+		if (memcmp(w->seen[slot], p, 3) == 0 && (slot != 53 || w->seen_black || p[0] | p[1] | p[2])) {
+			out_byte(out, slot);
+		} else {
+			memcpy(w->seen[slot], p, 3);
+			if (slot == 53 && !(p[0] | p[1] | p[2])) w->seen_black = 1;
+			int8_t dr = p[0] - w->prev[0], dg = p[1] - w->prev[1], db = p[2] - w->prev[2];
+			int8_t dr_dg = dr - dg, db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+				out_byte(out, 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+			} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+				out_byte(out, 0x80 | (dg + 32));
+				out_byte(out, (dr_dg + 8) << 4 | (db_dg + 8));
+			} else {
+				uint8_t op[4] = { 0xfe, p[0], p[1], p[2] };
+				out_bytes(out, op, 4);
+			}
+		}
+		memcpy(w->prev, p, 3);
+	}
+}
+
+// Append one row of width RGB pixels
+void writer_row(ImageWriter *w, const uint8_t *rgb) {
+	if (w->format == FORMAT_FARBFELD) {
+		expand_rgba16(w->expanded, rgb, w->width);
+		out_bytes(w->out, w->expanded, (size_t)w->width * 8);
+	} else if (w->format == FORMAT_QOI) {
+		qoi_row(w, rgb);
+	} else {
+		static const uint8_t filter = 0;
+		deflate_write(w->deflate, &filter, 1);
+		deflate_write(w->deflate, rgb, (size_t)w->width * 3);
+	}
+	w->rows++;
+}
+
+// Finish and close the file. Returns 0 on success, -1 with errno set on failure
+int writer_close(ImageWriter *w) {
+	OutBuffer *out = w->out;
+	if (w->format == FORMAT_QOI) {
+		qoi_run(w);
+		static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		out_bytes(out, end, sizeof(end));
+	} else if (w->format == FORMAT_PNG) {
+		Deflate *d = w->deflate;
+		deflate_compress(d, d->window_len);
+		put_symbol(d, 256);  // End of block
+		if (d->bit_count) put_bits(d, 0, 8 - d->bit_count);
+		uint32_t adler = d->adler_b << 16 | d->adler_a;
+		for (int i = 3; i >= 0; i--) idat_byte(d, adler >> (8 * i));
+		png_chunk(out, "IDAT", d->chunk, d->chunk_len);
+		png_chunk(out, "IEND", NULL, 0);
+	}
+	free(w->expanded);
+	out_flush(out);
+	if (w->rows != w->height && !out->error) {
+		// The header went out long ago: rewrite the height in place
+		uint8_t field[4], crc[4];
+		put_be32(field, w->rows);
+		off_t at = w->format == FORMAT_FARBFELD ? 12 : w->format == FORMAT_QOI ? 8 : 20;
+		if (pwrite(out->fd, field, 4, at) != 4) out->error = errno ? errno : EIO;
+		if (w->format == FORMAT_PNG) {
+			memcpy(w->ihdr + 4, field, 4);
+			put_be32(crc, ~crc32_update(crc32_update(~0u, (const uint8_t *)"IHDR", 4), w->ihdr, sizeof(w->ihdr)));
+			if (pwrite(out->fd, crc, 4, 29) != 4 && !out->error) out->error = errno ? errno : EIO;
+		}
+	}
+	return out_close(out);
+}
+
+// Write a card in the given format. Returns 0 on success, -1 with errno set on failure
+/* Record the time since start as writing, for what this thread spent in
+   write_all() since it had written, and encoding, for the rest. Time that
+   went to several cards at once is recorded as an equal share per card. */
+void stats_record_save(uint64_t start, uint64_t written, int cards) {
+	if (!stats_enabled) return;
+	int saved = errno;
+	if (cards < 1) cards = 1;
+	uint64_t total = stats_now() - start, writing = stat_write_ns - written;
+	for (int i = 0; i < cards; i++) {
+		stats_record(TIMER_WRITE, writing / cards);
+		stats_record(TIMER_ENCODE, (total > writing ? total - writing : 0) / cards);
+	}
+	errno = saved;
+}
+
+int save_image(const char *filename, Image *img, int format) {
+	STAT_START(start);
+	uint64_t written = stat_write_ns;
+	int result = -1;
+	if (format == FORMAT_FARBFELD) {
+		result = save_farbfeld(filename, img);
+	} else {
+		ImageWriter w;
+		if (writer_open(&w, filename, format, img->width, img->height) == 0) {
+			for (int y = 0; y < img->height; y++) writer_row(&w, PIXEL(img, 0, y));
+			result = writer_close(&w);
 		}
 	}
-	fclose(f);
+	stats_record_save(start, written, 1);
+	return result;
 }
 
 #define MAX_STROKES 5
@@ -273,7 +961,17 @@ CharRender font[95] = {
 	  
 };
 
-void draw_line(Image *img, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
+// Draw a line from x1, y1 up to but not including x2, y2
+void span_line(Image *img, Clip clip, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	// Horizontal and vertical lines, most of the font, are plain spans
+	if (y1 == y2) {
+		if (x1 != x2) span_hline(img, clip, y1, x1, x2 - (x1 < x2 ? 1 : -1), r, g, b);
+		return;
+	}
+	if (x1 == x2) {
+		span_vline(img, clip, x1, y1, y2 - (y1 < y2 ? 1 : -1), r, g, b);
+		return;
+	}
 	int dx = abs(x2 - x1), dy = abs(y2 - y1);
 	int sx = (x1 < x2) ? 1 : -1;
 	int sy = (y1 < y2) ? 1 : -1;
@@ -281,10 +979,11 @@ void draw_line(Image *img, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g,
 
 	while (x1 != x2 || y1 != y2) {
 
-		if (x1 >= 0 && x1 < WIDTH && y1 >= 0 && y1 < HEIGHT) {
-			img->pixels[y1][x1][0] = r;
-			img->pixels[y1][x1][1] = g;
-			img->pixels[y1][x1][2] = b;
+		if (x1 >= clip.x0 && x1 <= clip.x1 && y1 >= clip.y0 && y1 <= clip.y1) {
+			uint8_t *p = PIXEL(img, x1, y1);
+			p[0] = r;
+			p[1] = g;
+			p[2] = b;
 		}
 
 		int e2 = 2 * err;
@@ -293,14 +992,365 @@ void draw_line(Image *img, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g,
 	}
 }
 
+void draw_line(Image *img, int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b) {
+	if (!display_list) {
+		span_line(img, image_clip(img), x1, y1, x2, y2, r, g, b);
+		return;
+	}
+	Clip box = { x1 < x2 ? x1 : x2, y1 < y2 ? y1 : y2, x1 < x2 ? x2 : x1, y1 < y2 ? y2 : y1 };
+	record_primitive((Primitive){ .kind = PRIM_LINE, .r = r, .g = g, .b = b, .x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2, .box = box });
+}
+
+/* font[] compiled once into the layout draw_char() works from: only the
+   strokes that draw anything, with every coordinate in twentieths (all of
+   font[] lies on that grid, and font_unit[] gives back the exact floats). */
+typedef struct {
+	uint8_t count;
+	uint8_t strokes[MAX_STROKES][4];  // Start x, start y, end x, end y
+} PackedGlyph;
+
+PackedGlyph packed_font[95];
+float font_unit[21];
+pthread_once_t font_packed = PTHREAD_ONCE_INIT;
+
+void pack_font() {
+	for (int q = 0; q <= 20; q++) font_unit[q] = q / 20.0f;
+	for (int index = 0; index < 95; index++) {
+		PackedGlyph *glyph = &packed_font[index];
+		for (int i = 0; i < MAX_STROKES; i++) {
+			uint8_t stroke[4] = {
+				lroundf(font[index].startPos[2*i] * 20), lroundf(font[index].startPos[2*i+1] * 20),
+				lroundf(font[index].endPos[2*i] * 20), lroundf(font[index].endPos[2*i+1] * 20)
+			};
+			if (stroke[0] == stroke[2] && stroke[1] == stroke[3]) continue;  // Zero length, draws nothing
+			memcpy(glyph->strokes[glyph->count++], stroke, 4);
+		}
+	}
+}
+
+/* Glyph cache: every (character, width, height) a thread draws is traced
+   once into runs of covered pixels, relative to the glyph origin, and then
+   drawn by filling those runs. The stroke endpoints are still computed as
+   x1 + width*x with the same float math, since float rounding can move an
+   endpoint by a pixel depending on the origin: a glyph whose endpoints do
+   not land where the runs were traced is drawn stroke by stroke instead. */
+typedef struct {
+	uint64_t key;  // 0 for an empty slot
+	int count;
+	float ends[MAX_STROKES][4];  // width*x and height*(1-y) of every endpoint
+	int offsets[MAX_STROKES][4];  // Endpoints relative to the origin the runs were traced at
+	GlyphRun *runs;
+	int run_count;
+	Clip box;  // Bounds of the runs
+} Glyph;
+
+/* A display list points at the runs of the glyphs it draws, so glyphs are
+   only ever dropped between two lists, once there are GLYPH_CACHE_LIMIT. */
+#define GLYPH_CACHE_LIMIT 2048
+
+typedef struct {
+	Glyph *slots;
+	int size, used;
+} GlyphCache;
+
+_Thread_local GlyphCache glyph_cache;
+
+void draw_strokes(Image *img, const Glyph *glyph, int x1, int y1, uint8_t r, uint8_t g, uint8_t b) {
+	for (int i = 0; i < glyph->count; i++) {
+		draw_line(img, x1 + glyph->ends[i][0], y1 + glyph->ends[i][1], x1 + glyph->ends[i][2], y1 + glyph->ends[i][3], r, g, b);
+	}
+}
+
+// Turn a coverage mask whose top left pixel is at min_x, min_y into runs. Returns the number of runs
+int mask_runs(const uint8_t *mask, int mask_w, int mask_h, int min_x, int min_y, GlyphRun **runs) {
+	int count = 0, cap = 0;
+	*runs = NULL;
+	for (int y = 0; y < mask_h; y++) {
+		for (int x = 0; x < mask_w; x++) {
+			if (!mask[(size_t)y * mask_w + x]) continue;
+			int start = x;
+			while (x + 1 < mask_w && mask[(size_t)y * mask_w + x + 1]) x++;
+			if (count == cap) {
+				cap = cap ? cap * 2 : 16;
+				*runs = realloc(*runs, cap * sizeof(GlyphRun));
+				if (!*runs) {
+					perror("Cannot allocate glyph");
+					exit(1);
+				}
+			}
+			(*runs)[count++] = (GlyphRun){ y + min_y, start + min_x, x + min_x };
+		}
+	}
+	return count;
+}
+
+// Trace the glyph's strokes, drawn from an origin where they land on offsets, into runs
+void trace_glyph(Glyph *glyph) {
+	int min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+	for (int i = 0; i < glyph->count; i++) {
+		for (int k = 0; k < 4; k += 2) {
+			if (glyph->offsets[i][k] < min_x) min_x = glyph->offsets[i][k];
+			if (glyph->offsets[i][k] > max_x) max_x = glyph->offsets[i][k];
+			if (glyph->offsets[i][k+1] < min_y) min_y = glyph->offsets[i][k+1];
+			if (glyph->offsets[i][k+1] > max_y) max_y = glyph->offsets[i][k+1];
+		}
+	}
+	glyph->box = (Clip){ min_x, min_y, max_x, max_y };
+	int mask_w = max_x - min_x + 1, mask_h = max_y - min_y + 1;
+	uint8_t *mask = calloc((size_t)mask_w * mask_h, 1);
+	if (!mask) {
+		perror("Cannot allocate glyph");
+		exit(1);
+	}
+	for (int i = 0; i < glyph->count; i++) {
+		// Same walk as draw_line()
+		int x = glyph->offsets[i][0], y = glyph->offsets[i][1];
+		int x2 = glyph->offsets[i][2], y2 = glyph->offsets[i][3];
+		int dx = abs(x2 - x), dy = abs(y2 - y);
+		int sx = (x < x2) ? 1 : -1;
+		int sy = (y < y2) ? 1 : -1;
+		int err = dx - dy;
+		while (x != x2 || y != y2) {
+			mask[(size_t)(y - min_y) * mask_w + (x - min_x)] = 1;
+			int e2 = 2 * err;
+			if (e2 > -dy) { err -= dy; x += sx; }
+			if (e2 < dx) { err += dx; y += sy; }
+		}
+	}
+	glyph->run_count = mask_runs(mask, mask_w, mask_h, min_x, min_y, &glyph->runs);
+	free(mask);
+}
+
+void glyph_cache_trim() {
+	GlyphCache *cache = &glyph_cache;
+	if (cache->used < GLYPH_CACHE_LIMIT) return;
+	for (int i = 0; i < cache->size; i++) free(cache->slots[i].runs);
+	memset(cache->slots, 0, cache->size * sizeof(Glyph));
+	cache->used = 0;
+}
+
+Glyph *glyph_slot(GlyphCache *cache, uint64_t key) {
+	uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 40);
+	for (;; h++) {
+		Glyph *glyph = &cache->slots[h & (cache->size - 1)];
+		if (!glyph->key || glyph->key == key) return glyph;
+	}
+}
+
+// The cached glyph, traced at x1, y1 when it is new
+Glyph *find_glyph(int index, int x1, int y1, int width, int height) {
+	GlyphCache *cache = &glyph_cache;
+	if (!display_list) glyph_cache_trim();
+	if (cache->used * 4 >= cache->size * 3) {
+		// Grow; the runs stay where they are
+		GlyphCache grown = { calloc(cache->size ? cache->size * 2 : 1024, sizeof(Glyph)), cache->size ? cache->size * 2 : 1024, cache->used };
+		if (!grown.slots) {
+			perror("Cannot allocate glyph cache");
+			exit(1);
+		}
+		for (int i = 0; i < cache->size; i++) {
+			if (cache->slots[i].key) *glyph_slot(&grown, cache->slots[i].key) = cache->slots[i];
+		}
+		free(cache->slots);
+		*cache = grown;
+	}
+	uint64_t key = (uint64_t)(index + 1) << 56 | (uint64_t)(width & 0xFFFFFFF) << 28 | (height & 0xFFFFFFF);
+	Glyph *glyph = glyph_slot(cache, key);
+	if (glyph->key) return glyph;
+
+	pthread_once(&font_packed, pack_font);
+	const PackedGlyph *packed = &packed_font[index];
+	glyph->key = key;
+	glyph->count = packed->count;
+	for (int i = 0; i < packed->count; i++) {
+		for (int k = 0; k < 4; k += 2) {
+			glyph->ends[i][k] = width*font_unit[packed->strokes[i][k]];
+			glyph->ends[i][k+1] = height*(1-font_unit[packed->strokes[i][k+1]]);
+			glyph->offsets[i][k] = (int)(x1 + glyph->ends[i][k]) - x1;
+			glyph->offsets[i][k+1] = (int)(y1 + glyph->ends[i][k+1]) - y1;
+		}
+	}
+	trace_glyph(glyph);
+	cache->used++;
+	return glyph;
+}
+
+void span_runs(Image *img, Clip clip, const GlyphRun *runs, int count, int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+	for (int i = 0; i < count; i++) {
+		span_hline(img, clip, y + runs[i].y, x + runs[i].x0, x + runs[i].x1, r, g, b);
+	}
+}
+
+// Whether the glyph's endpoints land where its runs were traced when it is drawn at x1, y1
+int glyph_lands(const Glyph *glyph, int x1, int y1) {
+	for (int i = 0; i < glyph->count; i++) {
+		for (int k = 0; k < 4; k += 2) {
+			if ((int)(x1 + glyph->ends[i][k]) - x1 != glyph->offsets[i][k] || (int)(y1 + glyph->ends[i][k+1]) - y1 != glyph->offsets[i][k+1]) return 0;
+		}
+	}
+	return 1;
+}
+
 void draw_char(Image *img, char c, int x1, int y1, int width, int height, uint8_t r, uint8_t g, uint8_t b) {
 	if(c < 32 || c > 126) return;
-	int index = c - 32;
-	for(int i = 0; i < MAX_STROKES; ++i) {
-		int stroke_sx = x1 + width*font[index].startPos[2*i], stroke_sy = y1 + height*(1-font[index].startPos[2*i+1]);
-		int stroke_ex = x1 + width*font[index].endPos[2*i], stroke_ey = y1 + height*(1-font[index].endPos[2*i+1]);
-		draw_line(img, stroke_sx, stroke_sy, stroke_ex, stroke_ey, r, g, b);
+	const Glyph *glyph = find_glyph(c - 32, x1, y1, width, height);
+	if (!glyph_lands(glyph, x1, y1)) {
+		draw_strokes(img, glyph, x1, y1, r, g, b);
+		return;
+	}
+	if (!display_list) {
+		span_runs(img, image_clip(img), glyph->runs, glyph->run_count, x1, y1, r, g, b);
+		return;
+	}
+	Clip box = { x1 + glyph->box.x0, y1 + glyph->box.y0, x1 + glyph->box.x1, y1 + glyph->box.y1 };
+	if (glyph->run_count) record_primitive((Primitive){ .kind = PRIM_RUNS, .r = r, .g = g, .b = b, .x1 = x1, .y1 = y1, .box = box, .runs = glyph->runs, .run_count = glyph->run_count });
+}
+
+/* Text-run cache: a whole line of text (a type line, a name, a line of
+   card text) is merged from its glyphs into one set of runs, so drawing it
+   again is a single primitive. A run only depends on the characters and
+   their size and spacing: the colour is applied when it is drawn, and its
+   position does not matter as long as no endpoint is one that float
+   rounding would move depending on the origin. Such lines, and lines drawn
+   off the image's top or left, are drawn glyph by glyph as before. */
+typedef struct {
+	uint64_t hash;  // 0 for an empty slot
+	char *text;
+	int len, char_w, char_h, spacing;
+	int stable;  // Every glyph lands at the same offsets wherever the line is drawn
+	GlyphRun *runs;
+	int run_count;
+	Clip box;
+} TextRun;
+
+#define TEXT_CACHE_LIMIT 1024  // Like glyphs, runs are only dropped between two display lists
+#define STABLE_LIMIT 2048  // Origins and endpoints below this keep the offset of a glyph endpoint at (int)e
+
+typedef struct {
+	TextRun *slots;
+	int size, used;
+} TextCache;
+
+_Thread_local TextCache text_cache;
+
+void text_cache_trim() {
+	TextCache *cache = &text_cache;
+	if (cache->used < TEXT_CACHE_LIMIT) return;
+	for (int i = 0; i < cache->size; i++) {
+		free(cache->slots[i].text);
+		free(cache->slots[i].runs);
 	}
+	memset(cache->slots, 0, cache->size * sizeof(TextRun));
+	cache->used = 0;
+}
+
+// Whether x + e truncates to x + (int)e for every origin x in [0, STABLE_LIMIT)
+int stable_end(float e) {
+	// x + e is below 2 * STABLE_LIMIT, where a float is exact to 2^-12: only a fraction this close to 1 can round up
+	return e >= 0 && e < STABLE_LIMIT && e - (int)e < 1 - 1.0f / 8192;
+}
+
+// Merge the glyphs of the line into runs relative to its origin
+void trace_text_run(TextRun *run) {
+	int advance = run->char_w + run->spacing;
+	run->stable = advance >= 0;
+	int min_x = 0, min_y = 0, max_x = 0, max_y = 0, any = 0;
+	for (int i = 0; i < run->len && run->stable; i++) {
+		char c = run->text[i];
+		if (c < 32 || c > 126) continue;
+		const Glyph *glyph = find_glyph(c - 32, 0, 0, run->char_w, run->char_h);
+		// The glyph's runs must also have been traced where its endpoints land at those offsets
+		for (int k = 0; k < glyph->count; k++) {
+			for (int e = 0; e < 4; e++) run->stable &= stable_end(glyph->ends[k][e]) && glyph->offsets[k][e] == (int)glyph->ends[k][e];
+		}
+		if (!glyph->run_count) continue;
+		int x = i * advance;
+		if (!any || x + glyph->box.x0 < min_x) min_x = x + glyph->box.x0;
+		if (!any || glyph->box.y0 < min_y) min_y = glyph->box.y0;
+		if (!any || x + glyph->box.x1 > max_x) max_x = x + glyph->box.x1;
+		if (!any || glyph->box.y1 > max_y) max_y = glyph->box.y1;
+		any = 1;
+	}
+	run->runs = NULL;
+	run->run_count = 0;
+	if (!run->stable || !any) return;
+
+	int mask_w = max_x - min_x + 1, mask_h = max_y - min_y + 1;
+	uint8_t *mask = calloc((size_t)mask_w * mask_h, 1);
+	if (!mask) {
+		perror("Cannot allocate text run");
+		exit(1);
+	}
+	for (int i = 0; i < run->len; i++) {
+		char c = run->text[i];
+		if (c < 32 || c > 126) continue;
+		const Glyph *glyph = find_glyph(c - 32, 0, 0, run->char_w, run->char_h);
+		for (int k = 0; k < glyph->run_count; k++) {
+			const GlyphRun *g = &glyph->runs[k];
+			memset(mask + (size_t)(g->y - min_y) * mask_w + (i * advance + g->x0 - min_x), 1, g->x1 - g->x0 + 1);
+		}
+	}
+	run->box = (Clip){ min_x, min_y, max_x, max_y };
+	run->run_count = mask_runs(mask, mask_w, mask_h, min_x, min_y, &run->runs);
+	free(mask);
+}
+
+TextRun *find_text_run(const char *text, int len, int char_w, int char_h, int spacing) {
+	TextCache *cache = &text_cache;
+	if (!display_list) text_cache_trim();
+	if (cache->used * 4 >= cache->size * 3) {
+		int size = cache->size ? cache->size * 2 : 256;
+		TextRun *slots = calloc(size, sizeof(TextRun));
+		if (!slots) {
+			perror("Cannot allocate text cache");
+			exit(1);
+		}
+		for (int i = 0; i < cache->size; i++) {
+			if (!cache->slots[i].hash) continue;
+			uint32_t h = (uint32_t)cache->slots[i].hash;
+			while (slots[h & (size - 1)].hash) h++;
+			slots[h & (size - 1)] = cache->slots[i];
+		}
+		free(cache->slots);
+		cache->slots = slots;
+		cache->size = size;
+	}
+	uint64_t hash = 14695981039346656037ull;  // FNV-1a
+	for (int i = 0; i < len; i++) hash = (hash ^ (uint8_t)text[i]) * 1099511628211ull;
+	int params[3] = { char_w, char_h, spacing };
+	for (int i = 0; i < 3; i++) hash = (hash ^ (uint32_t)params[i]) * 1099511628211ull;
+	if (!hash) hash = 1;
+	for (uint32_t h = (uint32_t)hash;; h++) {
+		TextRun *run = &cache->slots[h & (cache->size - 1)];
+		if (run->hash == hash && run->len == len && run->char_w == char_w && run->char_h == char_h && run->spacing == spacing && memcmp(run->text, text, len) == 0) return run;
+		if (run->hash) continue;
+		*run = (TextRun){ .hash = hash, .text = malloc(len + 1), .len = len, .char_w = char_w, .char_h = char_h, .spacing = spacing };
+		if (!run->text) {
+			perror("Cannot allocate text run");
+			exit(1);
+		}
+		memcpy(run->text, text, len);
+		trace_text_run(run);
+		cache->used++;
+		return run;
+	}
+}
+
+// Draw len characters of text in a line, char_w + spacing apart
+void draw_text_run(Image *img, const char *text, int len, int x, int y, int char_w, int char_h, int spacing, uint8_t r, uint8_t g, uint8_t b) {
+	if (len <= 0) return;
+	const TextRun *run = find_text_run(text, len, char_w, char_h, spacing);
+	if (!run->stable || x < 0 || y < 0 || x + (len - 1) * (char_w + spacing) >= STABLE_LIMIT || y >= STABLE_LIMIT) {
+		for (int i = 0; i < len; i++) draw_char(img, text[i], x + i * (char_w + spacing), y, char_w, char_h, r, g, b);
+		return;
+	}
+	if (!run->run_count) return;
+	if (!display_list) {
+		span_runs(img, image_clip(img), run->runs, run->run_count, x, y, r, g, b);
+		return;
+	}
+	Clip box = { x + run->box.x0, y + run->box.y0, x + run->box.x1, y + run->box.y1 };
+	record_primitive((Primitive){ .kind = PRIM_RUNS, .r = r, .g = g, .b = b, .x1 = x, .y1 = y, .box = box, .runs = run->runs, .run_count = run->run_count });
 }
 
 // Draw a string using draw_char
@@ -308,12 +1358,7 @@ void draw_string(Image *img, const char *str, int x, int y, int width, int heigh
 	int length = strlen(str);
 	if (length == 0) return;
 	int char_width = (width - (length - 1) * spacing) / length;
-	int cursor_x = x;
-	
-	for (const char *c = str; *c; c++) {
-		draw_char(img, *c, cursor_x, y, char_width, height, r, g, b);
-		cursor_x += char_width + spacing;
-	}
+	draw_text_run(img, str, length, x, y, char_width, height, spacing, r, g, b);
 }
 
 // Draw a string with line breaks
@@ -331,174 +1376,570 @@ void draw_breaking_string(Image *img, const char *str, int x, int y, int width,
 	
 	int line_height = (height - (line_count - 1) * line_spacing) / line_count;
 	int char_width = (width - (max_line - 1) * spacing) / max_line;
-	int cursor_y = y, cursor_x = x;
+	int cursor_y = y;
 	
-		for (const char *c = str; *c; c++) {
-		if (*c == '\n') {
-			cursor_y += line_height + spacing;
-			cursor_x = x;
-			continue;
-		}
-		draw_char(img, *c, cursor_x, cursor_y, char_width, line_height, r, g, b);
-		cursor_x += char_width + spacing;
+	for (const char *line = str;; line++) {
+		int length = strcspn(line, "\n");
+		draw_text_run(img, line, length, x, cursor_y, char_width, line_height, spacing, r, g, b);
+		line += length;
+		if (!*line) break;
+		cursor_y += line_height + spacing;
 	}
 }
 
-void draw_ratio_breaking_string(Image *img, const char *str, int x, int y, int width, int height, int spacing, int line_spacing, float char_ratio, uint8_t r, uint8_t g, uint8_t b) {
-	int str_len = strlen(str);
-	if (str_len == 0) return;
+/* Text layout for draw_ratio_breaking_string(): the text is measured once
+   into a table of words, then the largest character height whose word
+   wrapped lines fit the box is found by binary search. Layouts are kept
+   per thread by text and box, so the same rules text is laid out once. */
+typedef struct {
+	int start, len;  // Bytes of the text
+} LayoutSpan;
 
-	// Step 0: Find the longest line in the input text
-	int max_line_length = 0, current_line_length = 0;
-	for (const char *c = str; *c; c++) {
-		if (*c == '\n') {
-			if (current_line_length > max_line_length) max_line_length = current_line_length;
-			current_line_length = 0;
-		} else {
-			current_line_length++;
+typedef struct {
+	uint64_t hash;  // 0 for an empty slot
+	char *text;
+	int text_len, width, height, spacing, line_spacing;
+	float char_ratio;
+	int char_w, char_h;
+	LayoutSpan *lines;
+	int line_count;
+} TextLayout;
+
+#define LAYOUT_CACHE_LIMIT 1024
+
+typedef struct {
+	TextLayout *slots;
+	int size, used;
+} LayoutCache;
+
+_Thread_local LayoutCache layout_cache;
+
+// Words of the text, with an empty span ending every paragraph
+int measure_words(const char *text, int len, LayoutSpan **words) {
+	int count = 0, cap = 0;
+	*words = NULL;
+	for (int i = 0; i <= len; i++) {
+		if (count + 2 > cap) {
+			cap = cap ? cap * 2 : 64;
+			*words = realloc(*words, cap * sizeof(LayoutSpan));
+			if (!*words) {
+				perror("Cannot allocate text layout");
+				exit(1);
+			}
+		}
+		if (i == len || text[i] == '\n') {
+			if (i < len || i == 0 || text[i - 1] != '\n') (*words)[count++] = (LayoutSpan){ i, 0 };
+			continue;
 		}
+		if (text[i] == ' ') continue;
+		int start = i;
+		while (i + 1 < len && text[i + 1] != ' ' && text[i + 1] != '\n') i++;
+		(*words)[count++] = (LayoutSpan){ start, i - start + 1 };
 	}
-	if (current_line_length > max_line_length) max_line_length = current_line_length;
+	return count;
+}
 
-	int line_count;
-	for(int i = 0; i < 24; ++i) { // Prevent infinite loops
-		// Step 1: Compute total number of lines
-		int chars_in_line = 0;
-		line_count = 1;
-		for (const char *c = str; *c; c++) {
-			if (*c == '\n' || chars_in_line >= max_line_length) {
-				line_count++;
-				chars_in_line = 0;
-				if (*c == '\n') continue;
-			}
-			chars_in_line++;
+/* Wrap the words into lines of at most per_line characters, breaking words
+   that are longer than a line. Stores the lines if lines is not NULL and
+   returns how many there are. */
+int wrap_words(const LayoutSpan *words, int count, int per_line, LayoutSpan *lines) {
+	int line_count = 0;
+	for (int i = 0; i < count;) {
+		if (words[i].len == 0) {  // Empty paragraph
+			if (lines) lines[line_count] = (LayoutSpan){ words[i].start, 0 };
+			line_count++;
+			i++;
+			continue;
+		}
+		int start = words[i].start, end = start + words[i].len;
+		// A word longer than a line fills whole lines on its own first
+		while (end - start > per_line) {
+			if (lines) lines[line_count] = (LayoutSpan){ start, per_line };
+			line_count++;
+			start += per_line;
 		}
+		i++;
+		while (i < count && words[i].len && words[i].start + words[i].len - start <= per_line) {
+			end = words[i].start + words[i].len;
+			i++;
+		}
+		if (lines) lines[line_count] = (LayoutSpan){ start, end - start };
+		line_count++;
+		if (i < count && words[i].len == 0) i++;  // The paragraph's end, already taken care of
+	}
+	return line_count;
+}
 
-		// Step 2: Compute effective width-to-height ratio
-		float effective_ratio = ((float)line_count) * ((float)width) / ((float)max_line_length) / ((float)height);
+int chars_per_line(int width, int char_w, int spacing) {
+	if (char_w + spacing <= 0) return INT32_MAX;
+	int n = (width + spacing) / (char_w + spacing);
+	return n < 1 ? 1 : n;
+}
 
-		// Step 3: Adjust max line length
-		max_line_length *= sqrt(effective_ratio/char_ratio);
+void layout_text(TextLayout *layout) {
+	LayoutSpan *words;
+	int count = measure_words(layout->text, layout->text_len, &words);
+	int low = 1, high = layout->height;  // The largest height known to fit, and the smallest known not to, is searched between
+	while (low < high) {
+		int h = (low + high + 1) / 2;
+		int char_w = h * layout->char_ratio < 1 ? 1 : (int)(h * layout->char_ratio);
+		int lines = wrap_words(words, count, chars_per_line(layout->width, char_w, layout->spacing), NULL);
+		if ((long long)lines * h + (long long)(lines - 1) * layout->line_spacing <= layout->height) low = h;
+		else high = h - 1;
 	}
-	
-	if((float)width / char_ratio < (float)height) {
-		y += height - (int)((float)width / char_ratio);
+	layout->char_h = low;
+	layout->char_w = low * layout->char_ratio < 1 ? 1 : (int)(low * layout->char_ratio);
+	int per_line = chars_per_line(layout->width, layout->char_w, layout->spacing);
+	layout->line_count = wrap_words(words, count, per_line, NULL);
+	layout->lines = malloc((layout->line_count + 1) * sizeof(LayoutSpan));
+	if (!layout->lines) {
+		perror("Cannot allocate text layout");
+		exit(1);
 	}
+	wrap_words(words, count, per_line, layout->lines);
+	free(words);
+}
 
-	// Compute final character width & height
-	int char_height = (height - (line_count-1)*line_spacing) / line_count;
-	int char_width = ((float)char_height) * char_ratio;
-	if (char_height < 5) char_height = 1;
-	if (char_width < 1) char_width = 1;
-
-	// Render the text
-	int cursor_x = x, cursor_y = y;
-	int chars_in_line = 0;
-
-	for (const char *c = str; *c; c++) {
-		if (*c == '\n' || chars_in_line >= max_line_length) {
-			cursor_y += char_height + line_spacing;
-			cursor_x = x;
-			chars_in_line = 0;
-			if (*c == '\n') continue;
+const TextLayout *find_layout(const char *text, int width, int height, int spacing, int line_spacing, float char_ratio) {
+	LayoutCache *cache = &layout_cache;
+	if (cache->used >= LAYOUT_CACHE_LIMIT) {
+		for (int i = 0; i < cache->size; i++) {
+			free(cache->slots[i].text);
+			free(cache->slots[i].lines);
 		}
+		memset(cache->slots, 0, cache->size * sizeof(TextLayout));
+		cache->used = 0;
+	}
+	if (cache->used * 4 >= cache->size * 3) {
+		int size = cache->size ? cache->size * 2 : 64;
+		TextLayout *slots = calloc(size, sizeof(TextLayout));
+		if (!slots) {
+			perror("Cannot allocate layout cache");
+			exit(1);
+		}
+		for (int i = 0; i < cache->size; i++) {
+			if (!cache->slots[i].hash) continue;
+			uint32_t h = (uint32_t)cache->slots[i].hash;
+			while (slots[h & (size - 1)].hash) h++;
+			slots[h & (size - 1)] = cache->slots[i];
+		}
+		free(cache->slots);
+		cache->slots = slots;
+		cache->size = size;
+	}
+	int len = strlen(text);
+	uint64_t hash = 14695981039346656037ull;  // FNV-1a
+	for (int i = 0; i < len; i++) hash = (hash ^ (uint8_t)text[i]) * 1099511628211ull;
+	uint32_t ratio;
+	memcpy(&ratio, &char_ratio, sizeof(ratio));
+	uint32_t params[5] = { width, height, spacing, line_spacing, ratio };
+	for (int i = 0; i < 5; i++) hash = (hash ^ params[i]) * 1099511628211ull;
+	if (!hash) hash = 1;
+	for (uint32_t h = (uint32_t)hash;; h++) {
+		TextLayout *layout = &cache->slots[h & (cache->size - 1)];
+		if (layout->hash == hash && layout->text_len == len && layout->width == width && layout->height == height
+				&& layout->spacing == spacing && layout->line_spacing == line_spacing && layout->char_ratio == char_ratio
+				&& memcmp(layout->text, text, len) == 0) return layout;
+		if (layout->hash) continue;
+		*layout = (TextLayout){ .hash = hash, .text = malloc(len + 1), .text_len = len, .width = width, .height = height,
+			.spacing = spacing, .line_spacing = line_spacing, .char_ratio = char_ratio };
+		if (!layout->text) {
+			perror("Cannot allocate text layout");
+			exit(1);
+		}
+		memcpy(layout->text, text, len + 1);
+		layout_text(layout);
+		cache->used++;
+		return layout;
+	}
+}
 
-		draw_char(img, *c, cursor_x, cursor_y, char_width, char_height, r, g, b);
-		cursor_x += char_width + spacing;
-		chars_in_line++;
+// Draw text word wrapped in the box at the largest size that fits, characters char_ratio as wide as they are high
+void draw_ratio_breaking_string(Image *img, const char *str, int x, int y, int width, int height, int spacing, int line_spacing, float char_ratio, uint8_t r, uint8_t g, uint8_t b) {
+	if (!*str || width <= 0 || height <= 0) return;
+	const TextLayout *layout = find_layout(str, width, height, spacing, line_spacing, char_ratio);
+	for (int i = 0; i < layout->line_count; i++) {
+		draw_text_run(img, layout->text + layout->lines[i].start, layout->lines[i].len,
+			x, y + i * (layout->char_h + line_spacing), layout->char_w, layout->char_h, spacing, r, g, b);
 	}
 }
 
-void draw_circle(Image *img, int cx, int cy, int radius, uint8_t r, uint8_t g, uint8_t b) {
+void span_circle(Image *img, Clip clip, int cx, int cy, int radius, uint8_t r, uint8_t g, uint8_t b) {
 	int x = radius, y = 0;
 	int p = 1 - radius; // Initial decision parameter
 
 	while (x >= y) {
 		// Draw 8 symmetrical points
-		img->pixels[cy + y][cx + x][0] = r;
-		img->pixels[cy + y][cx + x][1] = g;
-		img->pixels[cy + y][cx + x][2] = b;
+		int points[8][2] = {
+			{ cx + x, cy + y }, { cx + x, cy - y }, { cx - x, cy + y }, { cx - x, cy - y },
+			{ cx + y, cy + x }, { cx + y, cy - x }, { cx - y, cy + x }, { cx - y, cy - x }
+		};
+		for (int i = 0; i < 8; i++) {
+			int px = points[i][0], py = points[i][1];
+			if (px < clip.x0 || px > clip.x1 || py < clip.y0 || py > clip.y1) continue;
+			uint8_t *q = PIXEL(img, px, py);
+			q[0] = r;
+			q[1] = g;
+			q[2] = b;
+		}
 
-		img->pixels[cy - y][cx + x][0] = r;
-		img->pixels[cy - y][cx + x][1] = g;
-		img->pixels[cy - y][cx + x][2] = b;
+		y++;
+		if (p <= 0) {
+			p += 2 * y + 1;
+		} else {
+			x--;
+			p += 2 * (y - x) + 1;
+		}
+	}
+}
 
-		img->pixels[cy + y][cx - x][0] = r;
-		img->pixels[cy + y][cx - x][1] = g;
-		img->pixels[cy + y][cx - x][2] = b;
+void draw_circle(Image *img, int cx, int cy, int radius, uint8_t r, uint8_t g, uint8_t b) {
+	if (!display_list) {
+		span_circle(img, image_clip(img), cx, cy, radius, r, g, b);
+		return;
+	}
+	Clip box = { cx - radius, cy - radius, cx + radius, cy + radius };
+	record_primitive((Primitive){ .kind = PRIM_CIRCLE, .r = r, .g = g, .b = b, .x1 = cx, .y1 = cy, .x2 = radius, .box = box });
+}
 
-		img->pixels[cy - y][cx - x][0] = r;
-		img->pixels[cy - y][cx - x][1] = g;
-		img->pixels[cy - y][cx - x][2] = b;
+// Blend the pixel at q toward r, g, b by a coverage out of 255
+void blend_pixel(uint8_t *q, uint8_t r, uint8_t g, uint8_t b, int coverage) {
+	q[0] = (r * coverage + q[0] * (255 - coverage) + 127) / 255;
+	q[1] = (g * coverage + q[1] * (255 - coverage) + 127) / 255;
+	q[2] = (b * coverage + q[2] * (255 - coverage) + 127) / 255;
+}
 
-		img->pixels[cy + x][cx + y][0] = r;
-		img->pixels[cy + x][cx + y][1] = g;
-		img->pixels[cy + x][cx + y][2] = b;
+/* Filled, anti-aliased circle: a pixel is covered by radius + 0.5 minus
+   the distance of its centre from cx, cy, clamped to [0, 1]. The pixels
+   covered entirely are filled as one span per row, and only the ring of
+   edge pixels either side of it is blended. */
+void span_disc(Image *img, Clip clip, int cx, int cy, int radius, uint8_t r, uint8_t g, uint8_t b) {
+	if (radius < 0) return;
+	const float inner = (radius - 0.5f) * (radius - 0.5f);
+	int y0 = cy - radius > clip.y0 ? cy - radius : clip.y0, y1 = cy + radius < clip.y1 ? cy + radius : clip.y1;
+	for (int y = y0; y <= y1; y++) {
+		const float dy2 = (float)(y - cy) * (y - cy);
+		int solid = dy2 <= inner ? (int)sqrtf(inner - dy2) : -1;  // Pixels cx - solid to cx + solid are covered
+		if (solid >= 0) span_hline(img, clip, y, cx - solid, cx + solid, r, g, b);
+		for (int dx = solid + 1; dx <= radius; dx++) {
+			int coverage = (int)lroundf((radius + 0.5f - sqrtf(dx * dx + dy2)) * 255);
+			if (coverage <= 0) break;
+			if (coverage > 255) coverage = 255;
+			for (int side = dx ? -1 : 1; side <= 1; side += 2) {
+				int x = cx + side * dx;
+				if (x >= clip.x0 && x <= clip.x1) blend_pixel(PIXEL(img, x, y), r, g, b, coverage);
+			}
+		}
+	}
+}
 
-		img->pixels[cy - x][cx + y][0] = r;
-		img->pixels[cy - x][cx + y][1] = g;
-		img->pixels[cy - x][cx + y][2] = b;
+void draw_disc(Image *img, int cx, int cy, int radius, uint8_t r, uint8_t g, uint8_t b) {
+	if (!display_list) {
+		span_disc(img, image_clip(img), cx, cy, radius, r, g, b);
+		return;
+	}
+	Clip box = { cx - radius, cy - radius, cx + radius, cy + radius };
+	record_primitive((Primitive){ .kind = PRIM_DISC, .r = r, .g = g, .b = b, .x1 = cx, .y1 = cy, .x2 = radius, .box = box });
+}
 
-		img->pixels[cy + x][cx - y][0] = r;
-		img->pixels[cy + x][cx - y][1] = g;
-		img->pixels[cy + x][cx - y][2] = b;
+/* Mana symbol sprites: every (symbol, size) a thread draws is composited
+   once, disc and glyph, into a small image premultiplied by its coverage,
+   so each symbol on a card is a single clipped blit. Display lists point
+   at sprites, so each one is allocated on its own and stays put when the
+   table grows; like glyphs, they are only dropped between two lists. */
+#define SPRITE_CACHE_LIMIT 256
 
-		img->pixels[cy - x][cx - y][0] = r;
-		img->pixels[cy - x][cx - y][1] = g;
-		img->pixels[cy - x][cx - y][2] = b;
+typedef struct Sprite {
+	uint64_t key;
+	int radius;  // 2 * radius + 1 pixels square, centred on the symbol
+	Image *color;  // Colour times coverage
+	uint8_t *alpha;  // Coverage, out of 255
+} Sprite;
 
-		y++;
-		if (p <= 0) {
-			p += 2 * y + 1;
-		} else {
-			x--;
-			p += 2 * (y - x) + 1;
+typedef struct {
+	Sprite **slots;  // NULL for an empty slot
+	int size, used;
+} SpriteCache;
+
+_Thread_local SpriteCache sprite_cache;
+
+void sprite_cache_trim() {
+	SpriteCache *cache = &sprite_cache;
+	if (cache->used < SPRITE_CACHE_LIMIT) return;
+	for (int i = 0; i < cache->size; i++) {
+		if (!cache->slots[i]) continue;
+		free_image(cache->slots[i]->color);
+		free(cache->slots[i]->alpha);
+		free(cache->slots[i]);
+	}
+	memset(cache->slots, 0, cache->size * sizeof(Sprite *));
+	cache->used = 0;
+}
+
+Sprite **sprite_slot(SpriteCache *cache, uint64_t key) {
+	uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 40);
+	for (;; h++) {
+		Sprite **slot = &cache->slots[h & (cache->size - 1)];
+		if (!*slot || (*slot)->key == key) return slot;
+	}
+}
+
+// Disc and glyph colours of a mana symbol: digits, C, S and anything else are grey on black
+void mana_colors(char symbol, uint8_t disc[3], uint8_t text[3]) {
+	static const struct { char symbol; uint8_t disc[3], text[3]; } colors[] = {
+		{ 'W', { 255, 255, 200 }, { 0, 0, 0 } },
+		{ 'U', { 50, 100, 255 }, { 255, 255, 255 } },
+		{ 'B', { 50, 50, 50 }, { 200, 200, 200 } },
+		{ 'R', { 200, 50, 50 }, { 255, 255, 255 } },
+		{ 'G', { 50, 150, 50 }, { 255, 255, 255 } },
+	};
+	memset(disc, 0, 3);
+	memset(text, 192, 3);
+	for (size_t i = 0; i < sizeof(colors) / sizeof(colors[0]); i++) {
+		if (colors[i].symbol != symbol) continue;
+		memcpy(disc, colors[i].disc, 3);
+		memcpy(text, colors[i].text, 3);
+	}
+}
+
+// Draw a glyph onto a sprite's colour and coverage, straight to the pixels even while a display list is recorded
+void sprite_char(Sprite *sprite, Image *cover, char c, int x1, int y1, int width, int height, const uint8_t text[3]) {
+	if (c < 32 || c > 126 || width <= 0 || height <= 0) return;
+	const Glyph *glyph = find_glyph(c - 32, x1, y1, width, height);
+	const Clip clip = image_clip(cover);
+	if (glyph_lands(glyph, x1, y1)) {
+		span_runs(sprite->color, clip, glyph->runs, glyph->run_count, x1, y1, text[0], text[1], text[2]);
+		span_runs(cover, clip, glyph->runs, glyph->run_count, x1, y1, 255, 255, 255);
+		return;
+	}
+	for (int i = 0; i < glyph->count; i++) {
+		int ends[4] = { x1 + glyph->ends[i][0], y1 + glyph->ends[i][1], x1 + glyph->ends[i][2], y1 + glyph->ends[i][3] };
+		span_line(sprite->color, clip, ends[0], ends[1], ends[2], ends[3], text[0], text[1], text[2]);
+		span_line(cover, clip, ends[0], ends[1], ends[2], ends[3], 255, 255, 255);
+	}
+}
+
+/* Composite a symbol: a disc of its colour with its glyph on top. A hybrid
+   symbol, such as W/U, is split down the middle between its two halves,
+   each with its own glyph at half the width. */
+void compose_sprite(Sprite *sprite, char symbol, char hybrid, int size) {
+	int radius = size / 2, side = 2 * radius + 1;
+	sprite->radius = radius;
+	sprite->color = new_image(side, side);
+	Image *cover = new_image(side, side);  // Drawn in white, so any channel is the coverage
+	sprite->alpha = malloc((size_t)side * side);
+	if (!sprite->color || !cover || !sprite->alpha) {
+		perror("Cannot allocate mana symbol");
+		exit(1);
+	}
+	char symbols[2] = { symbol, hybrid };
+	Clip halves[2] = { image_clip(cover), image_clip(cover) };
+	if (hybrid) {
+		halves[0].x1 = radius;
+		halves[1].x0 = radius + 1;
+	}
+	for (int h = 0; h < (hybrid ? 2 : 1); h++) {
+		uint8_t disc[3], text[3];
+		mana_colors(symbols[h], disc, text);
+		// Blended over black, the colour comes out premultiplied by the coverage
+		span_disc(sprite->color, halves[h], radius, radius, radius, disc[0], disc[1], disc[2]);
+		span_disc(cover, halves[h], radius, radius, radius, 255, 255, 255);
+		if (hybrid) sprite_char(sprite, cover, symbols[h], h ? radius + 1 : radius - size / 4, radius - size / 4, size / 4 - 1, size / 2, text);
+		else sprite_char(sprite, cover, symbol, radius - size / 4, radius - size / 4, size / 2, size / 2, text);
+	}
+	for (int i = 0; i < side * side; i++) sprite->alpha[i] = cover->pixels[3 * i];
+	free_image(cover);
+}
+
+// The cached sprite of a symbol, hybrid 0 unless it is one
+const Sprite *find_sprite(char symbol, char hybrid, int size) {
+	SpriteCache *cache = &sprite_cache;
+	if (!display_list) sprite_cache_trim();
+	if (cache->used * 4 >= cache->size * 3) {
+		// Grow; the sprites stay where they are
+		SpriteCache grown = { calloc(cache->size ? cache->size * 2 : 64, sizeof(Sprite *)), cache->size ? cache->size * 2 : 64, cache->used };
+		if (!grown.slots) {
+			perror("Cannot allocate sprite cache");
+			exit(1);
 		}
+		for (int i = 0; i < cache->size; i++) {
+			if (cache->slots[i]) *sprite_slot(&grown, cache->slots[i]->key) = cache->slots[i];
+		}
+		free(cache->slots);
+		*cache = grown;
+	}
+	uint64_t key = (uint64_t)(uint8_t)symbol << 40 | (uint64_t)(uint8_t)hybrid << 32 | (uint32_t)size;
+	Sprite **slot = sprite_slot(cache, key);
+	if (*slot) return *slot;
+	Sprite *sprite = *slot = calloc(1, sizeof(Sprite));
+	if (!sprite) {
+		perror("Cannot allocate mana symbol");
+		exit(1);
 	}
+	sprite->key = key;
+	compose_sprite(sprite, symbol, hybrid, size);
+	cache->used++;
+	return sprite;
 }
 
-void draw_mana_symbol(Image *img, char symbol, int x, int y, int size) {
-	// Draw outer circle (background color)
-	uint8_t br = 0, bg = 0, bb = 0; // Default: black background
-	if (symbol == 'W') { br = 255; bg = 255; bb = 200; } // White
-	if (symbol == 'U') { br = 50; bg = 100; bb = 255; } // Blue
-	if (symbol == 'B') { br = 50; bg = 50; bb = 50; }   // Black
-	if (symbol == 'R') { br = 200; bg = 50; bb = 50; }  // Red
-	if (symbol == 'G') { br = 50; bg = 150; bb = 50; }  // Green
-	draw_circle(img, x, y, size / 2, br, bg, bb);
+// Blit a sprite with its top left corner at x, y
+void span_sprite(Image *img, Clip clip, const Sprite *sprite, int x, int y) {
+	const int side = 2 * sprite->radius + 1;
+	int x0 = x > clip.x0 ? x : clip.x0, x1 = x + side - 1 < clip.x1 ? x + side - 1 : clip.x1;
+	int y0 = y > clip.y0 ? y : clip.y0, y1 = y + side - 1 < clip.y1 ? y + side - 1 : clip.y1;
+	for (int py = y0; py <= y1; py++) {
+		const uint8_t *s = PIXEL(sprite->color, x0 - x, py - y), *a = sprite->alpha + (size_t)(py - y) * side + (x0 - x);
+		uint8_t *q = PIXEL(img, x0, py);
+		for (int px = x0; px <= x1; px++, s += 3, q += 3, a++) {
+			if (*a == 255) {
+				memcpy(q, s, 3);
+			} else if (*a) {
+				for (int k = 0; k < 3; k++) {
+					int v = s[k] + (q[k] * (255 - *a) + 127) / 255;
+					q[k] = v > 255 ? 255 : v;
+				}
+			}
+		}
+	}
+}
+
+// Draw a mana symbol of the given diameter centred on x, y; hybrid is the second half of a hybrid symbol, or 0
+void draw_mana_symbol(Image *img, char symbol, char hybrid, int x, int y, int size) {
+	if (size <= 0) return;
+	const Sprite *sprite = find_sprite(symbol, hybrid, size);
+	int left = x - sprite->radius, top = y - sprite->radius;
+	if (!display_list) {
+		span_sprite(img, image_clip(img), sprite, left, top);
+		return;
+	}
+	Clip box = { left, top, x + sprite->radius, y + sprite->radius };
+	record_primitive((Primitive){ .kind = PRIM_SPRITE, .x1 = left, .y1 = top, .box = box, .sprite = sprite });
+}
 
-	// Choose text color to contrast with the background
-	uint8_t r = 192, g = 192, b = 192; // Default: gray text
-	if (symbol == 'W') { r = 0; g = 0; b = 0; }   // Black text on white background
-	if (symbol == 'U') { r = 255; g = 255; b = 255; } // White text on blue background
-	if (symbol == 'B') { r = 200; g = 200; b = 200; } // Gray text on black background
-	if (symbol == 'R') { r = 255; g = 255; b = 255; } // White text on red background
-	if (symbol == 'G') { r = 255; g = 255; b = 255; } // White text on green background
+#define TILE_SIZE 64  // 12 KB of pixels, small enough to stay in cache while every primitive over it is drawn
 
-	// Draw text inside circle
-	draw_char(img, symbol, x - size / 4, y - size / 4, size / 2, size / 2, r, g, b);
+void draw_primitive(Image *img, Clip clip, const Primitive *p) {
+	switch (p->kind) {
+		case PRIM_RECT: span_rect(img, clip, p->x1, p->y1, p->x2, p->y2, p->r, p->g, p->b); break;
+		case PRIM_LINE: span_line(img, clip, p->x1, p->y1, p->x2, p->y2, p->r, p->g, p->b); break;
+		case PRIM_CIRCLE: span_circle(img, clip, p->x1, p->y1, p->x2, p->r, p->g, p->b); break;
+		case PRIM_DISC: span_disc(img, clip, p->x1, p->y1, p->x2, p->r, p->g, p->b); break;
+		case PRIM_RUNS: span_runs(img, clip, p->runs, p->run_count, p->x1, p->y1, p->r, p->g, p->b); break;
+		case PRIM_SPRITE: span_sprite(img, clip, p->sprite, p->x1, p->y1); break;
+	}
 }
 
-void render_card(Image *img, Entry entry) {
-	// Define card dimensions
-	int card_w = WIDTH, card_h = HEIGHT;
-	int outer_thickness = 8;
-	int border_thickness = 8;
-	int line_height = card_h / 16;
-	int art_area_h = card_h / 2;
+/* Draw a display list tile by tile. Every primitive is binned into the
+   tiles its box touches, and each tile then draws its primitives in list
+   order, clipped to the tile. A tile starts at the last rectangle covering
+   it entirely: whatever was drawn under it would be painted over anyway. */
+void rasterize(Image *img, const DisplayList *list) {
+	const int TILES_X = (img->width + TILE_SIZE - 1) / TILE_SIZE, TILES_Y = (img->height + TILE_SIZE - 1) / TILE_SIZE;
+	static _Thread_local int *bins, *starts;
+	static _Thread_local int bins_cap, starts_cap;
+	if (TILES_X * TILES_Y * 2 + 1 > starts_cap) {
+		free(starts);
+		starts_cap = TILES_X * TILES_Y * 2 + 1;
+		starts = malloc(starts_cap * sizeof(int));
+		if (!starts) {
+			perror("Cannot allocate tile bins");
+			exit(1);
+		}
+	}
+	int *fill = starts + TILES_X * TILES_Y + 1;
+	memset(starts, 0, (TILES_X * TILES_Y + 1) * sizeof(int));
 
-	// Determine border color
-	uint8_t r = 128, g = 128, b = 128; // Default to gray (colorless)
-	int color_count = 0;
-	
-	if (strchr(entry.cost, 'W')) { r = 255; g = 255; b = 200; color_count++; }
-	if (strchr(entry.cost, 'U')) { r = 100; g = 100; b = 255; color_count++; }
-	if (strchr(entry.cost, 'B')) { r = 80; g = 80; b = 80; color_count++; }
-	if (strchr(entry.cost, 'R')) { r = 255; g = 80; b = 80; color_count++; }
-	if (strchr(entry.cost, 'G')) { r = 80; g = 200; b = 80; color_count++; }
+	// Count the primitives of every tile, then lay the bins out one after another
+	int total = 0;
+	const Clip whole = image_clip(img);
+	for (int i = 0; i < list->count; i++) {
+		const Clip box = intersect_clip(list->items[i].box, whole);
+		for (int ty = box.y0 / TILE_SIZE; ty <= box.y1 / TILE_SIZE && box.x0 <= box.x1; ty++) {
+			for (int tx = box.x0 / TILE_SIZE; tx <= box.x1 / TILE_SIZE; tx++) starts[ty * TILES_X + tx + 1]++;
+		}
+	}
+	for (int t = 0; t < TILES_X * TILES_Y; t++) starts[t + 1] += starts[t];
+	total = starts[TILES_X * TILES_Y];
+	if (total > bins_cap) {
+		free(bins);
+		bins_cap = total * 2;
+		bins = malloc(bins_cap * sizeof(int));
+		if (!bins) {
+			perror("Cannot allocate tile bins");
+			exit(1);
+		}
+	}
+	memcpy(fill, starts, TILES_X * TILES_Y * sizeof(int));
+	for (int i = 0; i < list->count; i++) {
+		const Clip box = intersect_clip(list->items[i].box, whole);
+		for (int ty = box.y0 / TILE_SIZE; ty <= box.y1 / TILE_SIZE && box.x0 <= box.x1; ty++) {
+			for (int tx = box.x0 / TILE_SIZE; tx <= box.x1 / TILE_SIZE; tx++) bins[fill[ty * TILES_X + tx]++] = i;
+		}
+	}
 
-	// If multicolored, use gold border
-	if (color_count > 1) { r = 218; g = 165; b = 32; }
+	for (int ty = 0; ty < TILES_Y; ty++) {
+		for (int tx = 0; tx < TILES_X; tx++) {
+			int t = ty * TILES_X + tx;
+			Clip tile = { tx * TILE_SIZE, ty * TILE_SIZE, tx * TILE_SIZE + TILE_SIZE - 1, ty * TILE_SIZE + TILE_SIZE - 1 };
+			if (tile.x1 >= img->width) tile.x1 = img->width - 1;
+			if (tile.y1 >= img->height) tile.y1 = img->height - 1;
+			int first = starts[t];
+			for (int k = starts[t + 1] - 1; k > starts[t]; k--) {
+				const Primitive *p = &list->items[bins[k]];
+				if (p->kind == PRIM_RECT && p->box.x0 <= tile.x0 && p->box.y0 <= tile.y0 && p->box.x1 >= tile.x1 && p->box.y1 >= tile.y1) {
+					first = k;
+					break;
+				}
+			}
+			for (int k = first; k < starts[t + 1]; k++) {
+				const Primitive *p = &list->items[bins[k]];
+				draw_primitive(img, intersect_clip(tile, p->clip), p);
+			}
+		}
+	}
+}
+
+// Hash of everything render_card() output depends on: the fields it draws, the card size and the renderer version
+uint64_t card_hash(const Entry *entry, int width, int height) {
+	const char *fields[] = { entry->cost, entry->name, entry->type, entry->text };
+	uint64_t h = 14695981039346656037ull ^ RENDERER_VERSION;  // FNV-1a
+	if (width != WIDTH || height != HEIGHT) h = (h ^ ((uint64_t)width << 32 | (uint32_t)height)) * 1099511628211ull;
+	for (int i = 0; i < 4; i++) {
+		// The NUL terminator is hashed too, so text cannot move between fields unnoticed
+		for (const char *c = fields[i];; c++) {
+			h = (h ^ (uint8_t)*c) * 1099511628211ull;
+			if (!*c) break;
+		}
+	}
+	return h ? h : 1;  // 0 means "unknown" to the render cache
+}
+
+/* The layout of a card, relative to its size: the borders were designed
+   8 pixels wide on a WIDTH pixel card and scale with it, but never vanish. */
+typedef struct {
+	int card_w, card_h;
+	int outer_thickness, border_thickness;
+	int line_height, art_area_h;
+} CardLayout;
+
+CardLayout card_layout(const Image *img) {
+	CardLayout l = { .card_w = img->width, .card_h = img->height };
+	l.outer_thickness = (img->width * 8 + WIDTH / 2) / WIDTH;
+	if (l.outer_thickness < 1) l.outer_thickness = 1;
+	l.border_thickness = l.outer_thickness;
+	l.line_height = img->height / 16;
+	l.art_area_h = img->height / 2;
+	return l;
+}
+
+// Everything of a card that only depends on its border colour
+void draw_frame(Image *img, uint8_t r, uint8_t g, uint8_t b) {
+	CardLayout l = card_layout(img);
+	int card_w = l.card_w, card_h = l.card_h;
+	int outer_thickness = l.outer_thickness;
+	int border_thickness = l.border_thickness;
+	int line_height = l.line_height;
+	int art_area_h = l.art_area_h;
 
 	// Initialize the image with a black background
 	init_image(img, 0, 0, 0);
@@ -512,26 +1953,108 @@ void render_card(Image *img, Entry entry) {
 	draw_rect(img, outer_thickness+border_thickness, outer_thickness+border_thickness+line_height,
 			  card_w - outer_thickness - border_thickness, outer_thickness+border_thickness+line_height+art_area_h, 0, 0, 0);
 
+	// Draw text box
+	draw_rect(img, outer_thickness+border_thickness, outer_thickness+border_thickness+2*line_height+art_area_h,
+			  card_w - outer_thickness - border_thickness, card_h-outer_thickness, 240, 240, 240);
+}
+
+/* Frames are drawn once per border colour, card size and run, then copied.
+   There are only a handful: one per colour, gold and colourless. */
+#define MAX_FRAMES 16
+
+typedef struct {
+	uint8_t r, g, b;
+	Image *image;
+} CardFrame;
+
+CardFrame card_frames[MAX_FRAMES];
+int card_frame_count;
+pthread_mutex_t card_frame_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Start img as the frame of the given colour
+void copy_frame(Image *img, uint8_t r, uint8_t g, uint8_t b) {
+	const Image *frame = NULL;
+	pthread_mutex_lock(&card_frame_lock);
+	for (int i = 0; i < card_frame_count && !frame; i++) {
+		const CardFrame *f = &card_frames[i];
+		if (f->r == r && f->g == g && f->b == b && f->image->width == img->width && f->image->height == img->height) frame = f->image;
+	}
+	if (!frame && card_frame_count < MAX_FRAMES) {
+		Image *image = new_image(img->width, img->height);
+		if (image) {
+			draw_frame(image, r, g, b);
+			card_frames[card_frame_count++] = (CardFrame){ r, g, b, image };
+			frame = image;
+		}
+	}
+	pthread_mutex_unlock(&card_frame_lock);
+	if (frame) {
+		for (int y = 0; y < img->height; y++) memcpy(PIXEL(img, 0, y), PIXEL(frame, 0, y), (size_t)img->width * 3);
+	} else {
+		draw_frame(img, r, g, b);
+	}
+}
+
+void render_card(Image *img, const Entry *entry) {
+	STAT_START(start);
+	// Define card dimensions
+	CardLayout l = card_layout(img);
+	int card_w = l.card_w, card_h = l.card_h;
+	int outer_thickness = l.outer_thickness;
+	int border_thickness = l.border_thickness;
+	int line_height = l.line_height;
+	int art_area_h = l.art_area_h;
+
+	// Determine border color
+	uint8_t r = 128, g = 128, b = 128; // Default to gray (colorless)
+	int color_count = 0;
+	
+	if (strchr(entry->cost, 'W')) { r = 255; g = 255; b = 200; color_count++; }
+	if (strchr(entry->cost, 'U')) { r = 100; g = 100; b = 255; color_count++; }
+	if (strchr(entry->cost, 'B')) { r = 80; g = 80; b = 80; color_count++; }
+	if (strchr(entry->cost, 'R')) { r = 255; g = 80; b = 80; color_count++; }
+	if (strchr(entry->cost, 'G')) { r = 80; g = 200; b = 80; color_count++; }
+
+	// If multicolored, use gold border
+	if (color_count > 1) { r = 218; g = 165; b = 32; }
+
+	copy_frame(img, r, g, b);
+
+	static _Thread_local DisplayList list;
+	list.count = 0;
+	glyph_cache_trim();
+	text_cache_trim();
+	sprite_cache_trim();
+	display_list = &list;
+
+	// The text box is part of the frame, but it used to be drawn after the name and type line: keep them off it
+	display_clip = (Clip){ 0, 0, card_w - 1, outer_thickness+border_thickness+2*line_height+art_area_h - 1 };
+
+	// One symbol per character of the cost, except that X/Y is a single hybrid symbol
 	int mana_symbols = 0;
-	for (const char *c = entry.cost; *c; c++) {
+	for (const char *c = entry->cost; *c; c++) {
+		char hybrid = c[1] == '/' && c[2] ? c[2] : 0;
 		++mana_symbols;
-		draw_mana_symbol(img, *c, WIDTH-outer_thickness-border_thickness-mana_symbols*line_height+line_height/2, outer_thickness+border_thickness+line_height/2, line_height);
+		draw_mana_symbol(img, *c, hybrid, card_w-outer_thickness-border_thickness-mana_symbols*line_height+line_height/2, outer_thickness+border_thickness+line_height/2, line_height);
+		if (hybrid) c += 2;
 	}
 	// Draw name
-	draw_string(img, entry.name, outer_thickness+border_thickness, outer_thickness+border_thickness, 
+	draw_string(img, entry->name, outer_thickness+border_thickness, outer_thickness+border_thickness, 
 				card_w - 2*outer_thickness - 2*border_thickness - mana_symbols*line_height, line_height, 0, 0, 0, 0);
 
 	// Draw type line
-	draw_string(img, entry.type, outer_thickness+border_thickness, outer_thickness+border_thickness+line_height+art_area_h, 
+	draw_string(img, entry->type, outer_thickness+border_thickness, outer_thickness+border_thickness+line_height+art_area_h, 
 				card_w - 2*outer_thickness - 2*border_thickness, line_height, 0, 0, 0, 0);
 
-	// Draw text box
-	draw_rect(img, outer_thickness+border_thickness, outer_thickness+border_thickness+2*line_height+art_area_h,
-			  card_w - outer_thickness - border_thickness, card_h-outer_thickness, 240, 240, 240);
+	display_clip = image_clip(img);
 
 	// Draw card text
-	draw_ratio_breaking_string(img, entry.text, outer_thickness+border_thickness, outer_thickness+border_thickness+2*line_height+art_area_h, 
+	draw_ratio_breaking_string(img, entry->text, outer_thickness+border_thickness, outer_thickness+border_thickness+2*line_height+art_area_h, 
 						 card_w - 2*outer_thickness - 2*border_thickness, card_h-2*outer_thickness-border_thickness-2*line_height-art_area_h, 0, 0, 0.6, 0, 0, 0);
+
+	display_list = NULL;
+	rasterize(img, &list);
+	STAT_STOP(TIMER_RENDER, start);
 }
 
 #endif // CARD_RENDERER_H
@@ -1,32 +1,257 @@
-#define MAX_LINE 1024
+typedef const char *Str;
 
 typedef struct {
-	char name[MAX_LINE];
-	char cost[MAX_LINE];
-	char type[MAX_LINE];
-	char mainType[MAX_LINE];
-	char text[MAX_LINE * 2];
-	char power[MAX_LINE];
-	char toughness[MAX_LINE];
-	char loyalty[MAX_LINE];
+	Str name;
+	Str cost;
+	Str type;
+	Str mainType;
+	Str text;
+	Str power;
+	Str toughness;
+	Str loyalty;
 } Entry;
 
 #include "render.h"
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* Microbenchmarks: rendertest --bench [filter] times every primitive over
+   a sweep of its parameter and prints ns per call with a 95% confidence
+   interval, TSC cycles per pixel written and a checksum of what the case
+   draws. rendertest --checksums prints the checksums alone: diff them
+   before and after changing a kernel to prove its output identical. */
+#define BENCH_SAMPLES 20
+#define BENCH_T95 2.093  // Student's t for 19 degrees of freedom
+#define BENCH_WARMUP 0.05  // Seconds of warm-up, which also sizes the samples
+#define BENCH_SAMPLE 0.004  // Seconds per sample
+#define CHECK_CALLS 16  // Calls drawn on a clear image for the checksum
+
+typedef struct {
+	const char *name;
+	int param;
+	void (*run)(Image *img, int param, int i);
+	long pixels;  // Per call, 0 to count the pixels a call changes
+	const char *output;  // File the case writes, checksummed instead of the image
+} MicroCase;
+
+#define CASE(name, param, run) { name, param, run, 0, NULL }
+
+void bench_init(Image *img, int param, int i) {
+	(void)param;
+	init_image(img, 1 + (i & 1), 2, 3);
+}
+
+void bench_rect(Image *img, int size, int i) {
+	int x = (WIDTH - size) / 2, y = (HEIGHT - size) / 2;
+	draw_rect(img, x, y, x + size - 1, y + size - 1, 200, 100, 1 + (i & 127));
+}
+
+void bench_line(Image *img, int angle, int i) {
+	int dx = (int)lround(cos(angle * M_PI / 180) * 180), dy = (int)lround(sin(angle * M_PI / 180) * 180);
+	draw_line(img, WIDTH / 2 - dx, HEIGHT / 2 - dy, WIDTH / 2 + dx, HEIGHT / 2 + dy, 0, 255, 1 + (i & 127));
+}
+
+void bench_char(Image *img, int size, int i) {
+	draw_char(img, '!' + i % 94, 10, 10, size, size, 255, 255, 255);
+}
+
+void bench_circle(Image *img, int radius, int i) {
+	draw_circle(img, WIDTH / 2, HEIGHT / 2, radius, 255, 255, 1 + (i & 127));
+}
+
+void bench_disc(Image *img, int radius, int i) {
+	draw_disc(img, WIDTH / 2, HEIGHT / 2, radius, 255, 255, 1 + (i & 127));
+}
+
+void bench_mana(Image *img, int size, int i) {
+	draw_mana_symbol(img, "WUBRG"[i % 5], 0, WIDTH / 2, HEIGHT / 2, size);
+}
+
+// A card text of the given length, cut from a repeated rules text
+const char *bench_text(int length) {
+	static char texts[4][2048];
+	static const char words[] = "When this creature enters the battlefield, draw a card.\nCascade. Destroy target artifact or enchantment. ";
+	int slot = length <= 16 ? 0 : length <= 64 ? 1 : length <= 256 ? 2 : 3;
+	if (!texts[slot][0]) {
+		for (int k = 0; k < length && k < 2047; k++) texts[slot][k] = words[k % (sizeof(words) - 1)];
+	}
+	return texts[slot];
+}
+
+void bench_text_box(Image *img, int length, int i) {
+	(void)i;
+	draw_ratio_breaking_string(img, bench_text(length), 16, 280, WIDTH - 32, 220, 0, 0, 0.6, 255, 255, 255);
+}
+
+void bench_save(Image *img, int param, int i) {
+	(void)param;
+	(void)i;
+	if (save_farbfeld("microbench.ff", img) != 0) {
+		perror("Cannot write microbench.ff");
+		exit(1);
+	}
+}
+
+MicroCase micro_cases[] = {
+	{ "init_image", 0, bench_init, WIDTH * HEIGHT, NULL },
+	CASE("draw_rect", 4, bench_rect), CASE("draw_rect", 16, bench_rect), CASE("draw_rect", 64, bench_rect), CASE("draw_rect", 256, bench_rect),
+	CASE("draw_line", 0, bench_line), CASE("draw_line", 15, bench_line), CASE("draw_line", 30, bench_line), CASE("draw_line", 45, bench_line),
+	CASE("draw_line", 60, bench_line), CASE("draw_line", 75, bench_line), CASE("draw_line", 90, bench_line),
+	CASE("draw_char", 8, bench_char), CASE("draw_char", 16, bench_char), CASE("draw_char", 32, bench_char), CASE("draw_char", 64, bench_char),
+	CASE("draw_circle", 4, bench_circle), CASE("draw_circle", 16, bench_circle), CASE("draw_circle", 64, bench_circle), CASE("draw_circle", 180, bench_circle),
+	CASE("draw_disc", 4, bench_disc), CASE("draw_disc", 16, bench_disc), CASE("draw_disc", 64, bench_disc), CASE("draw_disc", 180, bench_disc),
+	CASE("draw_mana_symbol", 16, bench_mana), CASE("draw_mana_symbol", 32, bench_mana), CASE("draw_mana_symbol", 64, bench_mana),
+	CASE("draw_ratio_breaking_string", 16, bench_text_box), CASE("draw_ratio_breaking_string", 64, bench_text_box),
+	CASE("draw_ratio_breaking_string", 256, bench_text_box), CASE("draw_ratio_breaking_string", 1024, bench_text_box),
+	{ "save_farbfeld", 0, bench_save, WIDTH * HEIGHT, "microbench.ff" },
+};
+
+double seconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+uint64_t cycles() {
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// FNV-1a of the bytes of a file
+uint64_t file_checksum(const char *filename) {
+	uint64_t h = 14695981039346656037ull;
+	FILE *file = fopen(filename, "rb");
+	if (!file) {
+		perror(filename);
+		exit(1);
+	}
+	int c;
+	while ((c = getc(file)) != EOF) h = (h ^ (uint8_t)c) * 1099511628211ull;
+	fclose(file);
+	return h;
+}
+
+/* FNV-1a of every pixel, or of the file the case writes, after CHECK_CALLS
+   calls on a black image. Also counts the pixels the first call changes. */
+uint64_t case_checksum(Image *img, const MicroCase *c, long *changed) {
+	memset(img->pixels, 0, img->stride * img->height);
+	c->run(img, c->param, 0);
+	*changed = 0;
+	for (int y = 0; y < img->height; y++) {
+		const uint8_t *p = PIXEL(img, 0, y);
+		for (int x = 0; x < img->width; x++) *changed += p[3 * x] | p[3 * x + 1] | p[3 * x + 2] ? 1 : 0;
+	}
+	for (int i = 1; i < CHECK_CALLS; i++) c->run(img, c->param, i);
+	if (c->output) return file_checksum(c->output);
+	uint64_t h = 14695981039346656037ull;
+	for (int y = 0; y < img->height; y++) {
+		const uint8_t *p = PIXEL(img, 0, y);
+		for (int x = 0; x < img->width * 3; x++) h = (h ^ p[x]) * 1099511628211ull;
+	}
+	return h;
+}
+
+int run_benchmarks(const char *filter, int timed) {
+	Image *img = new_image(WIDTH, HEIGHT);
+	if (!img) {
+		perror("Cannot allocate image");
+		return 1;
+	}
+	if (timed) printf("%-28s %5s %12s %9s %10s  %s\n", "case", "param", "ns/call", "95% ci", "cycles/px", "checksum");
+	for (size_t k = 0; k < sizeof(micro_cases) / sizeof(micro_cases[0]); k++) {
+		const MicroCase *c = &micro_cases[k];
+		if (filter && !strstr(c->name, filter)) continue;
+		long changed;
+		uint64_t checksum = case_checksum(img, c, &changed);
+		if (!timed) {
+			printf("%s %d %016llx\n", c->name, c->param, (unsigned long long)checksum);
+			continue;
+		}
+		long pixels = c->pixels ? c->pixels : changed;
+
+		// Warm the caches up, and size the samples from how fast it went
+		long calls = 0;
+		double start = seconds();
+		while (seconds() - start < BENCH_WARMUP) c->run(img, c->param, calls++);
+		long batch = calls * BENCH_SAMPLE / BENCH_WARMUP;
+		if (batch < 1) batch = 1;
+
+		double ns[BENCH_SAMPLES], sum = 0, tsc_sum = 0;
+		for (int s = 0; s < BENCH_SAMPLES; s++) {
+			double t = seconds();
+			uint64_t tsc = cycles();
+			for (long i = 0; i < batch; i++) c->run(img, c->param, i);
+			tsc_sum += (double)(cycles() - tsc) / batch;
+			ns[s] = (seconds() - t) * 1e9 / batch;
+			sum += ns[s];
+		}
+		double mean = sum / BENCH_SAMPLES, var = 0;
+		for (int s = 0; s < BENCH_SAMPLES; s++) var += (ns[s] - mean) * (ns[s] - mean);
+		double ci = BENCH_T95 * sqrt(var / (BENCH_SAMPLES - 1)) / sqrt(BENCH_SAMPLES);
+		char per_pixel[32] = "-";
+#ifdef HAVE_TSC
+		if (pixels > 0) snprintf(per_pixel, sizeof(per_pixel), "%.3f", tsc_sum / BENCH_SAMPLES / pixels);
+#endif
+		printf("%-28s %5d %12.1f %8.1f%% %10s  %016llx\n", c->name, c->param, mean, mean > 0 ? ci / mean * 100 : 0, per_pixel, (unsigned long long)checksum);
+		fflush(stdout);
+	}
+	unlink("microbench.ff");
+	free_image(img);
+	return 0;
+}
+
+/* Regression: a card whose mana symbols grow the sprite cache while its
+   display list is recorded must still draw the sprites recorded before.
+   The second card is drawn again once every sprite is cached, and both
+   renders have to match (run under -fsanitize=address to see the reads). */
+int check_sprite_cache() {
+	Entry many = { "Many", "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijk", "Instant", "Instant", "", "", "", "" };
+	Entry hybrid = { "Hybrid", "2/Wz", "Instant", "Instant", "", "", "", "" };
+	Image *first = new_image(WIDTH, HEIGHT), *again = new_image(WIDTH, HEIGHT);
+	if (!first || !again) {
+		perror("Cannot allocate image");
+		return 1;
+	}
+	render_card(first, &many);
+	render_card(first, &hybrid);
+	render_card(again, &hybrid);
+	int same = memcmp(first->pixels, again->pixels, first->stride * first->height) == 0;
+	if (!same) fprintf(stderr, "Sprite cache: a card drew differently once its symbols were cached\n");
+	free_image(first);
+	free_image(again);
+	return !same;
+}
 
 int main(int argc, char **argv) {
-	Image img;
-	init_image(&img, 0, 0, 127);
-	draw_rect(&img, 0, 32, 128, 64, 255, 0, 0);
-	draw_line(&img, WIDTH-1, 0, 0, HEIGHT-1, 0, 255, 0);
-	draw_circle(&img, WIDTH/2, HEIGHT/2, 64, 255, 255, 0);
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) return run_benchmarks(argc > 2 ? argv[2] : NULL, 1);
+	if (argc > 1 && strcmp(argv[1], "--checksums") == 0) return run_benchmarks(argc > 2 ? argv[2] : NULL, 0);
+	Image *img = new_image(WIDTH, HEIGHT);
+	if (!img) {
+		perror("Cannot allocate image");
+		return 1;
+	}
+	init_image(img, 0, 0, 127);
+	draw_rect(img, 0, 32, 128, 64, 255, 0, 0);
+	draw_line(img, WIDTH-1, 0, 0, HEIGHT-1, 0, 255, 0);
+	draw_circle(img, WIDTH/2, HEIGHT/2, 64, 255, 255, 0);
 
 	
-	draw_breaking_string(&img, " !\"#$%&'()*+,-./\n0123456789:;<=>?\n@ABCDEFGHIJKLMNO\nPQRSTUVWXYZ[\\]^_\n`abcdefghijklmno\npqrstuvwxyz{|}~", 16, 256, WIDTH-32, 256, 0, 2, 127, 127, 127);
+	draw_breaking_string(img, " !\"#$%&'()*+,-./\n0123456789:;<=>?\n@ABCDEFGHIJKLMNO\nPQRSTUVWXYZ[\\]^_\n`abcdefghijklmno\npqrstuvwxyz{|}~", 16, 256, WIDTH-32, 256, 0, 2, 127, 127, 127);
 	
-	draw_ratio_breaking_string(&img, "This is a test", 10, 10, 200, 100, 2, 5, 0.6, 255, 255, 255);
-	draw_ratio_breaking_string(&img, "This is a test that is very long !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\nAnd has multiple lines\n!!!", 10, 120, 200, 100, 2, 5, 0.6, 255, 255, 255);
+	draw_ratio_breaking_string(img, "This is a test", 10, 10, 200, 100, 2, 5, 0.6, 255, 255, 255);
+	draw_ratio_breaking_string(img, "This is a test that is very long !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\nAnd has multiple lines\n!!!", 10, 120, 200, 100, 2, 5, 0.6, 255, 255, 255);
 
 	
-	save_farbfeld("test.ff", &img);
+	if (save_farbfeld("test.ff", img) != 0) {
+		perror("Cannot write test.ff");
+		return 1;
+	}
+	return check_sprite_cache();
 }
 